@@ -26,10 +26,19 @@ struct Launch_Settings {
     int h = 360;
     int s = 256;
     int d = 8;
+    int rr_depth = 3;
     bool animate = false;
     float exp = 1.0f;
     bool w_from_ar = false;
     bool no_bvh = false;
+    bool wide_bvh = false;
+    bool wavefront = false;
+    bool ray_sort = false;
+    float adaptive_threshold = 0.0f;
+    std::string heatmap_file;
+    std::string sampler = "sobol";
+    uint32_t seed = 0;
+    std::string bvh_cache_dir;
 };
 
 class App {
@@ -73,16 +73,31 @@ void Simulate::build_scene(Scene& scene) {
     std::vector<PT::Object> obj_list;
     std::vector<std::future<PT::Object>> futures;
 
+    // Animation rebuilds the scene every frame; meshes that only moved since the last build
+    // are refit in place rather than rebuilt.
+    std::unordered_map<Scene_ID, std::shared_ptr<PT::Tri_Mesh>> previous = std::move(meshes);
+    meshes.clear();
+
     scene.for_items([&, this](Scene_Item& item) {
         if(item.is<Scene_Object>()) {
             Scene_Object& obj = item.get<Scene_Object>();
-            futures.push_back(thread_pool.enqueue([&]() {
+            std::shared_ptr<PT::Tri_Mesh> mesh;
+            if(!obj.is_shape()) {
+                auto entry = previous.find(obj.id());
+                mesh = entry != previous.end() ? entry->second : std::make_shared<PT::Tri_Mesh>();
+                meshes[obj.id()] = mesh;
+            }
+            futures.push_back(thread_pool.enqueue([&, mesh]() {
                 if(obj.is_shape()) {
                     PT::Shape shape(obj.opt.shape);
                     return PT::Object(std::move(shape), obj.id(), 0, obj.pose.transform());
                 } else {
-                    PT::Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
-                    return PT::Object(std::move(mesh), obj.id(), 0, obj.pose.transform());
+                    const GL::Mesh& posed = obj.posed_mesh();
+                    if(!mesh->refit(posed, &thread_pool)) {
+                        mesh->build(posed, use_bvh, false, &thread_pool);
+                    }
+                    return PT::Object(PT::Tri_Mesh_Instance(mesh), obj.id(), 0,
+                                      obj.pose.transform());
                 }
             }));
         }
@@ -93,7 +108,7 @@ void Simulate::build_scene(Scene& scene) {
     }
 
     if(use_bvh) {
-        scene_obj = PT::Object(PT::BVH<PT::Object>(std::move(obj_list)));
+        scene_obj = PT::Object(PT::BVH<PT::Object>(std::move(obj_list), 1, &thread_pool));
     } else {
         scene_obj = PT::Object(PT::List<PT::Object>(std::move(obj_list)));
     }
@@ -129,6 +144,7 @@ Mode Simulate::UIsidebar(Manager& manager, Scene& scene, Undo& undo, Widgets& wi
     ImGui::Text("Simulation");
 
     if(ImGui::Checkbox("Use BVH", &use_bvh)) {
+        meshes.clear();
         clear_particles(scene);
         build_scene(scene);
     }
@@ -36,6 +36,7 @@ public:
 
 private:
     PT::Object scene_obj;
+    std::unordered_map<Scene_ID, std::shared_ptr<PT::Tri_Mesh>> meshes;
     bool use_bvh = true;
 
     Thread_Pool thread_pool;
@@ -641,7 +641,14 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     if(method == 1) {
         ImGui::InputInt("Samples", &out_samples, 1, 100);
         ImGui::InputInt("Max Ray Depth", &out_depth, 1, 32);
+        ImGui::InputInt("Roulette Depth", &out_rr_depth, 1, 32);
+        static const char* sequence_names[] = {"Random", "Halton", "Sobol"};
+        ImGui::Combo("Sampler", &sequence, sequence_names, 3);
         ImGui::SliderFloat("Exposure", &exposure, 0.01f, 10.0f, "%.2f", 2.5f);
+        ImGui::Checkbox("Adaptive Sampling", &adaptive);
+        if(adaptive) {
+            ImGui::SliderFloat("Relative Error", &adaptive_threshold, 0.001f, 0.5f, "%.3f", 2.5f);
+        }
     } else {
         ImGui::Combo("Samples", (int*)&msaa.samples, GL::Sample_Count_Names, msaa.n_options());
         out_samples = msaa.n_samples();
@@ -651,6 +658,7 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     out_h = std::max(1, out_h);
     out_samples = std::max(1, out_samples);
     out_depth = std::max(1, out_depth);
+    out_rr_depth = std::max(1, out_rr_depth);
 
     if(ImGui::Button("Set Width via AR")) {
         out_w = (size_t)std::ceil(cam.get_ar() * out_h);
@@ -661,6 +669,10 @@ void Widget_Render::begin(Scene& scene, Widget_Camera& cam, Camera& user_cam) {
     }
     ImGui::SameLine();
     ImGui::Checkbox("Use BVH", &use_bvh);
+    if(use_bvh) {
+        ImGui::SameLine();
+        ImGui::Checkbox("Wide BVH", &wide_bvh);
+    }
 }
 
 std::string Widget_Render::step(Animate& animate, Scene& scene) {
@@ -729,7 +741,7 @@ std::string Widget_Render::step(Animate& animate, Scene& scene) {
                 }
 
                 animate.step_sim(scene);
-                pathtracer.begin_render(scene, cam);
+                pathtracer.begin_render(scene, cam, false, true);
                 next_frame++;
             }
         }
@@ -781,7 +793,10 @@ void Widget_Render::animate(Scene& scene, Widget_Camera& cam, Camera& user_cam,
             if(method == 1) {
                 init = true;
                 ray_log.clear();
-                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh);
+                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh, wide_bvh,
+                                      adaptive ? adaptive_threshold : 0.0f);
+                pathtracer.set_sequence((RNG::Sequence)sequence);
+                pathtracer.set_rr_depth(out_rr_depth);
             }
         }
     }
@@ -834,7 +849,10 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
                 has_rendered = true;
                 ret = true;
                 ray_log.clear();
-                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh);
+                pathtracer.set_params(out_w, out_h, out_samples, out_depth, use_bvh, wide_bvh,
+                                      adaptive ? adaptive_threshold : 0.0f);
+                pathtracer.set_sequence((RNG::Sequence)sequence);
+                pathtracer.set_rr_depth(out_rr_depth);
                 pathtracer.begin_render(scene, cam.get());
             } else {
                 Renderer::get().save(scene, cam.get(), out_w, out_h, out_samples);
@@ -877,6 +895,8 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
             pathtracer.set_samples((int)out_samples);
             pathtracer.begin_render(scene, cam.get(), true);
         }
+        ImGui::SameLine();
+        ImGui::Checkbox("Sample Heatmap", &show_heatmap);
     }
 
     float avail = ImGui::GetContentRegionAvail().x;
@@ -884,12 +904,24 @@ bool Widget_Render::UI(Scene& scene, Widget_Camera& cam, Camera& user_cam, std::
     float h = (w / out_w) * out_h;
 
     if(method == 1) {
-        ImGui::Image((ImTextureID)(long long)pathtracer.get_output_texture(exposure).get_id(),
-                     {w, h});
+        const GL::Tex2D& tex = show_heatmap ? pathtracer.get_heatmap().get_texture(1.0f)
+                                            : pathtracer.get_output_texture(exposure);
+        ImGui::Image((ImTextureID)(long long)tex.get_id(), {w, h});
 
         if(!pathtracer.in_progress() && has_rendered) {
             auto [build, render] = pathtracer.completion_time();
             ImGui::Text("Scene built in %.2fs, rendered in %.2fs.", build, render);
+
+            PT::Trace_Stats stats = pathtracer.stats();
+            if(stats.rays) {
+                ImGui::Text("%.2f BVH nodes and %.2f primitives tested per ray.",
+                            (float)stats.nodes / stats.rays, (float)stats.primitives / stats.rays);
+            }
+            if(stats.secondary) {
+                ImGui::Text("%.1f%% of secondary rays hit, at %.2f Mrays/s per thread.",
+                            100.0f * stats.secondary_hits / stats.secondary,
+                            1e3f * stats.secondary / stats.secondary_ns);
+            }
         }
     } else {
         ImGui::Image((ImTextureID)(long long)Renderer::get().saved(), {w, h}, {0.0f, 1.0f},
@@ -908,13 +940,39 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
     info("\theight: %d", set.h);
     info("\tsamples: %d", set.s);
     info("\tmax depth: %d", set.d);
+    info("\troulette depth: %d", set.rr_depth);
     info("\texposure: %f", set.exp);
     info("\trender threads: %u", std::thread::hardware_concurrency());
     if(set.no_bvh) info("\tusing object list instead of BVH");
+    else if(set.wide_bvh) info("\tusing %d-wide BVH", PT::MBVH<PT::Object>::width);
+    if(set.adaptive_threshold > 0.0f) info("\tadaptive threshold: %f", set.adaptive_threshold);
+    if(set.wavefront) {
+        info("\tusing wavefront engine%s", set.ray_sort ? " with ray sorting" : "");
+    }
+    info("\tsampler: %s", set.sampler.c_str());
+    info("\tseed: %u", set.seed);
+    if(!set.bvh_cache_dir.empty()) info("\tBVH cache: %s", set.bvh_cache_dir.c_str());
 
     out_w = set.w;
     out_h = set.h;
-    pathtracer.set_params(set.w, set.h, set.s, set.d, !set.no_bvh);
+    pathtracer.set_params(set.w, set.h, set.s, set.d, !set.no_bvh, set.wide_bvh,
+                          set.adaptive_threshold);
+    if(set.sampler == "random") pathtracer.set_sequence(RNG::Sequence::random);
+    else if(set.sampler == "halton") pathtracer.set_sequence(RNG::Sequence::halton);
+    else pathtracer.set_sequence(RNG::Sequence::sobol);
+    pathtracer.set_seed(set.seed);
+    pathtracer.set_wavefront(set.wavefront);
+    pathtracer.set_ray_sorting(set.ray_sort);
+    pathtracer.set_rr_depth(set.rr_depth);
+    pathtracer.set_bvh_cache(set.bvh_cache_dir);
+
+    auto print_cache_stats = [this]() {
+        PT::BVH_Cache::Stats cache = pathtracer.bvh_cache_stats();
+        if(cache.hits + cache.misses == 0) return;
+        info("BVH cache: %zu hits (loaded in %.1fms), %zu misses (built in %.1fms)", cache.hits,
+             cache.load_ms, cache.misses, cache.build_ms);
+        if(cache.failed_writes) warn("BVH cache: failed to write %zu BVHs", cache.failed_writes);
+    };
 
     auto print_progress = [](float f) {
         std::cout << "Progress: [";
@@ -949,6 +1007,7 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
             std::this_thread::sleep_for(std::chrono::milliseconds(250));
         }
         std::cout << std::endl;
+        print_cache_stats();
 
     } else {
 
@@ -958,12 +1017,32 @@ std::string Widget_Render::headless(Animate& animate, Scene& scene, const Camera
             std::this_thread::sleep_for(std::chrono::milliseconds(250));
         }
         std::cout << std::endl;
+        print_cache_stats();
+
+        PT::Trace_Stats stats = pathtracer.stats();
+        if(stats.rays) {
+            info("Traced %zu rays, %.2f BVH nodes and %.2f primitives tested per ray", stats.rays,
+                 (float)stats.nodes / stats.rays, (float)stats.primitives / stats.rays);
+        }
+        if(stats.secondary) {
+            info("Secondary rays: %.1f%% hit the scene, %.2f Mrays/s per thread",
+                 100.0f * stats.secondary_hits / stats.secondary,
+                 1e3f * stats.secondary / stats.secondary_ns);
+        }
 
         std::vector<unsigned char> data;
         pathtracer.get_output().tonemap_to(data, set.exp);
         if(!stbi_write_png(set.output_file.c_str(), set.w, set.h, 4, data.data(), set.w * 4)) {
             return "Failed to write output!";
         }
+
+        if(!set.heatmap_file.empty()) {
+            pathtracer.get_heatmap().tonemap_to(data, 1.0f);
+            if(!stbi_write_png(set.heatmap_file.c_str(), set.w, set.h, 4, data.data(),
+                               set.w * 4)) {
+                return "Failed to write heatmap!";
+            }
+        }
     }
 
     return {};
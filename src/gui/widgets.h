@@ -113,9 +113,9 @@ private:
     mutable std::mutex log_mut;
     GL::Lines ray_log;
 
-    int out_w, out_h, out_samples = 32, out_depth = 8;
-    float exposure = 1.0f;
-    bool use_bvh = true;
+    int out_w, out_h, out_samples = 32, out_depth = 8, out_rr_depth = 3, sequence = 2;
+    float exposure = 1.0f, adaptive_threshold = 0.05f;
+    bool use_bvh = true, wide_bvh = false, adaptive = false, show_heatmap = false;
 
     bool has_rendered = false;
     bool render_window = false, render_window_focus = false;
@@ -0,0 +1,92 @@
+
+#pragma once
+
+#include <cmath>
+#include <ostream>
+
+#include "mat4.h"
+#include "vec3.h"
+
+/// An affine transformation: a 3x3 linear part (stored by columns) followed by a
+/// translation. Holds the top three rows of a Mat4 whose bottom row is (0, 0, 0, 1).
+struct Affine {
+
+    /// Identity transformation
+    static const Affine I;
+
+    Affine() : cols{Vec3{1.0f, 0.0f, 0.0f}, Vec3{0.0f, 1.0f, 0.0f}, Vec3{0.0f, 0.0f, 1.0f}} {
+    }
+    /// Take the affine part of m, ignoring its bottom row
+    explicit Affine(const Mat4& m)
+        : cols{m[0].xyz(), m[1].xyz(), m[2].xyz()}, translation(m[3].xyz()) {
+    }
+    explicit Affine(Vec3 x, Vec3 y, Vec3 z, Vec3 t) : cols{x, y, z}, translation(t) {
+    }
+
+    Affine(const Affine&) = default;
+    Affine& operator=(const Affine&) = default;
+    ~Affine() = default;
+
+    /// Transform a point
+    Vec3 operator*(Vec3 v) const {
+        return rotate(v) + translation;
+    }
+    /// Transform a direction (ignores the translation)
+    Vec3 rotate(Vec3 v) const {
+        return v.x * cols[0] + v.y * cols[1] + v.z * cols[2];
+    }
+    /// Transform a direction by the transpose of the linear part. Called on the inverse
+    /// of a transformation, this maps surface normals through the transformation.
+    Vec3 rotate_transposed(Vec3 v) const {
+        return Vec3{dot(cols[0], v), dot(cols[1], v), dot(cols[2], v)};
+    }
+
+    /// Compose transformations: (l * r) applies r first
+    Affine operator*(const Affine& r) const {
+        return Affine{rotate(r.cols[0]), rotate(r.cols[1]), rotate(r.cols[2]),
+                      *this * r.translation};
+    }
+
+    /// Return inverse transformation (will be NaN if the linear part is not invertible).
+    /// The rows of the inverse linear part are the cross products of pairs of columns.
+    Affine inverse() const {
+        Vec3 r0 = cross(cols[1], cols[2]);
+        Vec3 r1 = cross(cols[2], cols[0]);
+        Vec3 r2 = cross(cols[0], cols[1]);
+        float inv_det = 1.0f / dot(cols[0], r0);
+        r0 *= inv_det;
+        r1 *= inv_det;
+        r2 *= inv_det;
+        Affine ret{Vec3{r0.x, r1.x, r2.x}, Vec3{r0.y, r1.y, r2.y}, Vec3{r0.z, r1.z, r2.z},
+                   Vec3{}};
+        ret.translation = -ret.rotate(translation);
+        return ret;
+    }
+
+    /// Expand to a full 4x4 matrix
+    Mat4 mat4() const {
+        return Mat4{Vec4{cols[0], 0.0f}, Vec4{cols[1], 0.0f}, Vec4{cols[2], 0.0f},
+                    Vec4{translation, 1.0f}};
+    }
+
+    Vec3 cols[3];
+    Vec3 translation;
+};
+
+const inline Affine Affine::I = Affine{};
+
+inline bool operator==(const Affine& l, const Affine& r) {
+    for(int i = 0; i < 3; i++)
+        if(l.cols[i] != r.cols[i]) return false;
+    return l.translation == r.translation;
+}
+
+inline bool operator!=(const Affine& l, const Affine& r) {
+    return !(l == r);
+}
+
+inline std::ostream& operator<<(std::ostream& out, const Affine& a) {
+    out << "{" << a.cols[0] << "," << a.cols[1] << "," << a.cols[2] << "," << a.translation
+        << "}";
+    return out;
+}
@@ -7,6 +7,7 @@
 #include <ostream>
 #include <vector>
 
+#include "affine.h"
 #include "mat4.h"
 #include "ray.h"
 #include "vec2.h"
@@ -60,12 +61,15 @@ struct BBox {
 
     /// Transform box by a matrix
     void transform(const Mat4& trans) {
+        transform(Affine(trans));
+    }
+    void transform(const Affine& trans) {
         Vec3 amin = min, amax = max;
-        min = max = trans[3].xyz();
+        min = max = trans.translation;
         for(int i = 0; i < 3; i++) {
             for(int j = 0; j < 3; j++) {
-                float a = trans[j][i] * amin[j];
-                float b = trans[j][i] * amax[j];
+                float a = trans.cols[j][i] * amin[j];
+                float b = trans.cols[j][i] * amax[j];
                 if(a < b) {
                     min[i] += a;
                     max[i] += b;
@@ -79,6 +83,11 @@ struct BBox {
 
     // TODO (PathTracer): see student/bbox.cpp
     bool hit(const Ray& ray, Vec2& times) const;
+    bool hit(const Traversal_Ray& ray, Vec2& times) const;
+    /// Tests the ray against two boxes at once. Returns a bitmask of the boxes hit (1 for
+    /// a, 2 for b) and updates the times of each box that was hit.
+    static int hit(const BBox& a, const BBox& b, const Traversal_Ray& ray, Vec2& times_a,
+                   Vec2& times_b);
 
     /// Get the eight corner points of the bounding box
     std::vector<Vec3> corners() const {
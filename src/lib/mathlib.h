@@ -49,6 +49,7 @@ inline float smoothstep(float e0, float e1, float x) {
     return t * t * (3.0f - 2.0f * t);
 }
 
+#include "affine.h"
 #include "bbox.h"
 #include "mat4.h"
 #include "quat.h"
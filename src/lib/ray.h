@@ -2,11 +2,14 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <ostream>
 
+#include "../lib/affine.h"
 #include "../lib/mathlib.h"
 #include "../lib/spectrum.h"
+#include "../lib/vec3a.h"
 
 struct Ray {
 
@@ -35,6 +38,13 @@ struct Ray {
         dist_bounds *= d;
         dir /= d;
     }
+    void transform(const Affine& trans) {
+        point = trans * point;
+        dir = trans.rotate(dir);
+        float d = dir.norm();
+        dist_bounds *= d;
+        dir /= d;
+    }
 
     /// The origin or starting point of this ray
     Vec3 point;
@@ -50,6 +60,26 @@ struct Ray {
     mutable Vec2 dist_bounds = Vec2(0.0f, std::numeric_limits<float>::infinity());
 };
 
+/// A ray prepared for repeated bounding box tests: the reciprocal of its direction and
+/// the sign of each component are computed once, when traversal begins
+struct Traversal_Ray {
+
+    Traversal_Ray() = default;
+    explicit Traversal_Ray(const Ray& ray)
+        : point(ray.point), inv_dir(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z,
+                                    std::numeric_limits<float>::infinity()) {
+        for(int i = 0; i < 3; i++) sign[i] = inv_dir[i] < 0.0f;
+    }
+
+    /// Stored four-wide for SIMD slab tests. The padding lane of inv_dir is infinite, so
+    /// that (as 0 * inf) it gives NaN in any test against a padded box.
+    Vec3A point;
+    Vec3A inv_dir;
+    /// Whether the ray travels towards -infinity along each axis, i.e. enters a box
+    /// through its max side
+    uint8_t sign[3] = {};
+};
+
 inline std::ostream& operator<<(std::ostream& out, Ray r) {
     out << "Ray{" << r.point << "," << r.dir << "}";
     return out;
@@ -0,0 +1,316 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_SSE
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+/// Kernels on four packed floats, which Vec3A and Spectrum4 are built on. F4 is an SSE or
+/// NEON register where available and a plain array otherwise. Whatever the backend, min
+/// and max return their second operand when either is NaN (as SSE does), and comparisons
+/// return masks with every bit set in the lanes where they hold.
+namespace SIMD {
+
+#if defined(SIMD_SSE)
+
+using F4 = __m128;
+
+inline F4 set(float x, float y, float z, float w) {
+    return _mm_setr_ps(x, y, z, w);
+}
+inline F4 splat(float s) {
+    return _mm_set1_ps(s);
+}
+inline void store(F4 a, float* out) {
+    _mm_storeu_ps(out, a);
+}
+
+inline F4 add(F4 a, F4 b) {
+    return _mm_add_ps(a, b);
+}
+inline F4 sub(F4 a, F4 b) {
+    return _mm_sub_ps(a, b);
+}
+inline F4 mul(F4 a, F4 b) {
+    return _mm_mul_ps(a, b);
+}
+inline F4 div(F4 a, F4 b) {
+    return _mm_div_ps(a, b);
+}
+inline F4 min(F4 a, F4 b) {
+    return _mm_min_ps(a, b);
+}
+inline F4 max(F4 a, F4 b) {
+    return _mm_max_ps(a, b);
+}
+
+inline F4 less(F4 a, F4 b) {
+    return _mm_cmplt_ps(a, b);
+}
+inline F4 equal(F4 a, F4 b) {
+    return _mm_cmpeq_ps(a, b);
+}
+/// Lanes of a where mask is set, and of b elsewhere
+inline F4 select(F4 mask, F4 a, F4 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+/// One bit per lane of a comparison mask, lane 0 in the lowest bit
+inline int bits(F4 mask) {
+    return _mm_movemask_ps(mask);
+}
+
+/// Horizontal reductions over all four lanes
+inline float hsum(F4 a) {
+    __m128 s = _mm_add_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(s, s)));
+}
+inline float hmin(F4 a) {
+    __m128 m = _mm_min_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_movehl_ps(m, m)));
+}
+inline float hmax(F4 a) {
+    __m128 m = _mm_max_ps(a, _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_movehl_ps(m, m)));
+}
+
+/// Rounds to the nearest integer (ties to even)
+inline F4 round(F4 a) {
+    return _mm_cvtepi32_ps(_mm_cvtps_epi32(a));
+}
+/// 2^n for integer n in [-126, 127]
+inline F4 pow2i(F4 n) {
+    __m128i e = _mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127));
+    return _mm_castsi128_ps(_mm_slli_epi32(e, 23));
+}
+/// Splits positive normal floats into a = m * 2^e with m in [1, 2)
+inline void frexp(F4 a, F4& m, F4& e) {
+    __m128i i = _mm_castps_si128(a);
+    e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(i, 23), _mm_set1_epi32(127)));
+    m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(i, _mm_set1_epi32(0x007fffff)),
+                                      _mm_set1_epi32(0x3f800000)));
+}
+
+#elif defined(SIMD_NEON)
+
+using F4 = float32x4_t;
+
+inline F4 set(float x, float y, float z, float w) {
+    float v[4] = {x, y, z, w};
+    return vld1q_f32(v);
+}
+inline F4 splat(float s) {
+    return vdupq_n_f32(s);
+}
+inline void store(F4 a, float* out) {
+    vst1q_f32(out, a);
+}
+
+inline F4 add(F4 a, F4 b) {
+    return vaddq_f32(a, b);
+}
+inline F4 sub(F4 a, F4 b) {
+    return vsubq_f32(a, b);
+}
+inline F4 mul(F4 a, F4 b) {
+    return vmulq_f32(a, b);
+}
+inline F4 div(F4 a, F4 b) {
+    return vdivq_f32(a, b);
+}
+
+inline F4 less(F4 a, F4 b) {
+    return vreinterpretq_f32_u32(vcltq_f32(a, b));
+}
+inline F4 equal(F4 a, F4 b) {
+    return vreinterpretq_f32_u32(vceqq_f32(a, b));
+}
+inline F4 select(F4 mask, F4 a, F4 b) {
+    return vbslq_f32(vreinterpretq_u32_f32(mask), a, b);
+}
+inline int bits(F4 mask) {
+    uint32x4_t m = vshrq_n_u32(vreinterpretq_u32_f32(mask), 31);
+    return (int)(vgetq_lane_u32(m, 0) | vgetq_lane_u32(m, 1) << 1 | vgetq_lane_u32(m, 2) << 2 |
+                 vgetq_lane_u32(m, 3) << 3);
+}
+
+// vminq/vmaxq propagate NaN, so these select instead to match SSE
+inline F4 min(F4 a, F4 b) {
+    return select(less(a, b), a, b);
+}
+inline F4 max(F4 a, F4 b) {
+    return select(less(b, a), a, b);
+}
+
+inline float hsum(F4 a) {
+    return vaddvq_f32(a);
+}
+inline float hmin(F4 a) {
+    return vminvq_f32(a);
+}
+inline float hmax(F4 a) {
+    return vmaxvq_f32(a);
+}
+
+inline F4 round(F4 a) {
+    return vrndnq_f32(a);
+}
+inline F4 pow2i(F4 n) {
+    int32x4_t e = vaddq_s32(vcvtnq_s32_f32(n), vdupq_n_s32(127));
+    return vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+}
+inline void frexp(F4 a, F4& m, F4& e) {
+    uint32x4_t i = vreinterpretq_u32_f32(a);
+    e = vcvtq_f32_s32(vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(i, 23)), vdupq_n_s32(127)));
+    m = vreinterpretq_f32_u32(
+        vorrq_u32(vandq_u32(i, vdupq_n_u32(0x007fffff)), vdupq_n_u32(0x3f800000)));
+}
+
+#else
+
+struct F4 {
+    float v[4];
+};
+
+template<typename F> inline F4 map(F4 a, F4 b, F&& f) {
+    return F4{{f(a.v[0], b.v[0]), f(a.v[1], b.v[1]), f(a.v[2], b.v[2]), f(a.v[3], b.v[3])}};
+}
+inline float mask_of(bool b) {
+    uint32_t u = b ? 0xffffffffu : 0u;
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+}
+inline bool is_set(float f) {
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u >> 31;
+}
+
+inline F4 set(float x, float y, float z, float w) {
+    return F4{{x, y, z, w}};
+}
+inline F4 splat(float s) {
+    return F4{{s, s, s, s}};
+}
+inline void store(F4 a, float* out) {
+    for(int i = 0; i < 4; i++) out[i] = a.v[i];
+}
+
+inline F4 add(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return x + y; });
+}
+inline F4 sub(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return x - y; });
+}
+inline F4 mul(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return x * y; });
+}
+inline F4 div(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return x / y; });
+}
+inline F4 min(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return x < y ? x : y; });
+}
+inline F4 max(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return x > y ? x : y; });
+}
+
+inline F4 less(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return mask_of(x < y); });
+}
+inline F4 equal(F4 a, F4 b) {
+    return map(a, b, [](float x, float y) { return mask_of(x == y); });
+}
+inline F4 select(F4 mask, F4 a, F4 b) {
+    F4 r;
+    for(int i = 0; i < 4; i++) r.v[i] = is_set(mask.v[i]) ? a.v[i] : b.v[i];
+    return r;
+}
+inline int bits(F4 mask) {
+    int r = 0;
+    for(int i = 0; i < 4; i++) r |= is_set(mask.v[i]) << i;
+    return r;
+}
+
+inline float hsum(F4 a) {
+    return (a.v[0] + a.v[1]) + (a.v[2] + a.v[3]);
+}
+inline float hmin(F4 a) {
+    return std::min(std::min(a.v[0], a.v[1]), std::min(a.v[2], a.v[3]));
+}
+inline float hmax(F4 a) {
+    return std::max(std::max(a.v[0], a.v[1]), std::max(a.v[2], a.v[3]));
+}
+
+inline F4 round(F4 a) {
+    return map(a, a, [](float x, float) { return std::nearbyint(x); });
+}
+inline F4 pow2i(F4 n) {
+    return map(n, n, [](float x, float) { return std::ldexp(1.0f, (int)x); });
+}
+inline void frexp(F4 a, F4& m, F4& e) {
+    for(int i = 0; i < 4; i++) {
+        int exp;
+        m.v[i] = 2.0f * std::frexp(a.v[i], &exp);
+        e.v[i] = (float)(exp - 1);
+    }
+}
+
+#endif
+
+/// 2^a, accurate to about 1e-7 relative error. Inputs are clamped to [-126, 127].
+inline F4 exp2(F4 a) {
+    a = min(max(a, splat(-126.0f)), splat(127.0f));
+    F4 n = round(a), f = sub(a, n);
+    // Taylor series of e^(f ln 2), for |f| <= 1/2
+    F4 p = splat(1.5252734e-5f);
+    p = add(mul(p, f), splat(1.5403530e-4f));
+    p = add(mul(p, f), splat(1.3333558e-3f));
+    p = add(mul(p, f), splat(9.6181291e-3f));
+    p = add(mul(p, f), splat(5.5504109e-2f));
+    p = add(mul(p, f), splat(2.4022651e-1f));
+    p = add(mul(p, f), splat(6.9314718e-1f));
+    p = add(mul(p, f), splat(1.0f));
+    return mul(p, pow2i(n));
+}
+
+/// log2(a) for positive normal a, accurate to about 1e-7: absolute error for results within
+/// (-1, 1), relative error beyond
+inline F4 log2(F4 a) {
+    F4 m, e;
+    frexp(a, m, e);
+    // Center the mantissa on 1, so that t below stays within [-0.172, 0.172]
+    F4 high = less(splat(1.41421356f), m);
+    m = select(high, mul(m, splat(0.5f)), m);
+    e = select(high, add(e, splat(1.0f)), e);
+    // ln(m) = 2 atanh(t) with t = (m - 1) / (m + 1)
+    F4 t = div(sub(m, splat(1.0f)), add(m, splat(1.0f))), t2 = mul(t, t);
+    F4 s = splat(1.0f / 9.0f);
+    s = add(mul(s, t2), splat(1.0f / 7.0f));
+    s = add(mul(s, t2), splat(1.0f / 5.0f));
+    s = add(mul(s, t2), splat(1.0f / 3.0f));
+    s = add(mul(s, t2), splat(1.0f));
+    return add(e, mul(mul(t, s), splat(2.0f * 1.44269504f)));
+}
+
+/// e^a. Rounding a * log2(e) adds a relative error of about |a| * 6e-8, so about 1e-6
+/// for |a| <= 16.
+inline F4 exp(F4 a) {
+    return exp2(mul(a, splat(1.44269504f)));
+}
+
+/// a^b for positive normal a. As for exp(), the relative error grows with |b * log2(a)|.
+inline F4 pow(F4 a, F4 b) {
+    return exp2(mul(b, log2(a)));
+}
+
+} // namespace SIMD
@@ -0,0 +1,98 @@
+
+#pragma once
+
+#include <ostream>
+
+#include "simd.h"
+#include "spectrum.h"
+
+/// A Spectrum padded to four floats and aligned to 16 bytes, so that its arithmetic maps to
+/// single SIMD instructions. The padding lane is kept at zero. Used for the radiance and
+/// throughput that the render loops accumulate; convert to Spectrum at their boundaries.
+struct alignas(16) Spectrum4 {
+
+    Spectrum4() : v(SIMD::splat(0.0f)) {
+    }
+    explicit Spectrum4(float r, float g, float b) : v(SIMD::set(r, g, b, 0.0f)) {
+    }
+    explicit Spectrum4(float f) : v(SIMD::set(f, f, f, 0.0f)) {
+    }
+    explicit Spectrum4(Spectrum s) : v(SIMD::set(s.r, s.g, s.b, 0.0f)) {
+    }
+    explicit Spectrum4(SIMD::F4 v) : v(v) {
+    }
+
+    Spectrum4(const Spectrum4&) = default;
+    Spectrum4& operator=(const Spectrum4&) = default;
+    ~Spectrum4() = default;
+
+    Spectrum spectrum() const {
+        return Spectrum(r, g, b);
+    }
+
+    Spectrum4 operator+=(Spectrum4 s) {
+        v = SIMD::add(v, s.v);
+        return *this;
+    }
+    Spectrum4 operator*=(Spectrum4 s) {
+        v = SIMD::mul(v, s.v);
+        return *this;
+    }
+    Spectrum4 operator*=(float s) {
+        v = SIMD::mul(v, SIMD::splat(s));
+        return *this;
+    }
+
+    Spectrum4 operator+(Spectrum4 s) const {
+        return Spectrum4(SIMD::add(v, s.v));
+    }
+    Spectrum4 operator-(Spectrum4 s) const {
+        return Spectrum4(SIMD::sub(v, s.v));
+    }
+    Spectrum4 operator*(Spectrum4 s) const {
+        return Spectrum4(SIMD::mul(v, s.v));
+    }
+    Spectrum4 operator*(float s) const {
+        return Spectrum4(SIMD::mul(v, SIMD::splat(s)));
+    }
+
+    float luma() const {
+        return SIMD::hsum(SIMD::mul(v, SIMD::set(0.2126f, 0.7152f, 0.0722f, 0.0f)));
+    }
+
+    /// Are all channels finite? (Only finite values give zero when subtracted from themselves.)
+    bool valid() const {
+        return SIMD::bits(SIMD::equal(SIMD::sub(v, v), SIMD::splat(0.0f))) == 0xf;
+    }
+
+    /// sRGB encoding of each channel in [0, 1], accurate to about 2e-7
+    Spectrum4 to_srgb() const {
+        SIMD::F4 low = SIMD::mul(v, SIMD::splat(12.92f));
+        // pow() needs positive inputs, which the high branch is only taken for
+        SIMD::F4 safe = SIMD::max(v, SIMD::splat(0.0031308f));
+        SIMD::F4 high = SIMD::sub(
+            SIMD::mul(SIMD::pow(safe, SIMD::splat(1.0f / 2.4f)), SIMD::splat(1.055f)),
+            SIMD::splat(0.055f));
+        return Spectrum4(SIMD::select(SIMD::less(SIMD::splat(0.0031308f), v), high, low));
+    }
+
+    union {
+        SIMD::F4 v;
+        struct {
+            float r;
+            float g;
+            float b;
+            float pad;
+        };
+        float data[4];
+    };
+};
+
+inline Spectrum4 operator*(float s, Spectrum4 v) {
+    return v * s;
+}
+
+inline std::ostream& operator<<(std::ostream& out, Spectrum4 v) {
+    out << "Spectrum{" << v.r << "," << v.g << "," << v.b << "}";
+    return out;
+}
@@ -0,0 +1,111 @@
+
+#pragma once
+
+#include <ostream>
+
+#include "simd.h"
+#include "vec3.h"
+
+/// A Vec3 padded to four floats and aligned to 16 bytes, so that its arithmetic maps to
+/// single SIMD instructions. The padding lane w is zero unless set explicitly. Meant for
+/// hot loops: convert to and from Vec3 at their boundaries.
+struct alignas(16) Vec3A {
+
+    Vec3A() : v(SIMD::splat(0.0f)) {
+    }
+    explicit Vec3A(float x, float y, float z, float w = 0.0f) : v(SIMD::set(x, y, z, w)) {
+    }
+    explicit Vec3A(float f) : v(SIMD::set(f, f, f, 0.0f)) {
+    }
+    explicit Vec3A(Vec3 u) : v(SIMD::set(u.x, u.y, u.z, 0.0f)) {
+    }
+    explicit Vec3A(SIMD::F4 v) : v(v) {
+    }
+
+    Vec3A(const Vec3A&) = default;
+    Vec3A& operator=(const Vec3A&) = default;
+    ~Vec3A() = default;
+
+    /// Unlike Vec3, lane accesses are not bounds checked, as that keeps them out of line
+    float& operator[](int idx) {
+        return data[idx];
+    }
+    float operator[](int idx) const {
+        return data[idx];
+    }
+
+    Vec3 vec3() const {
+        return Vec3(x, y, z);
+    }
+
+    Vec3A operator+=(Vec3A u) {
+        v = SIMD::add(v, u.v);
+        return *this;
+    }
+    Vec3A operator-=(Vec3A u) {
+        v = SIMD::sub(v, u.v);
+        return *this;
+    }
+    Vec3A operator*=(Vec3A u) {
+        v = SIMD::mul(v, u.v);
+        return *this;
+    }
+    Vec3A operator*=(float s) {
+        v = SIMD::mul(v, SIMD::splat(s));
+        return *this;
+    }
+
+    Vec3A operator+(Vec3A u) const {
+        return Vec3A(SIMD::add(v, u.v));
+    }
+    Vec3A operator-(Vec3A u) const {
+        return Vec3A(SIMD::sub(v, u.v));
+    }
+    Vec3A operator*(Vec3A u) const {
+        return Vec3A(SIMD::mul(v, u.v));
+    }
+    Vec3A operator/(Vec3A u) const {
+        return Vec3A(SIMD::div(v, u.v));
+    }
+    Vec3A operator*(float s) const {
+        return Vec3A(SIMD::mul(v, SIMD::splat(s)));
+    }
+    Vec3A operator-() const {
+        return Vec3A(SIMD::sub(SIMD::splat(0.0f), v));
+    }
+
+    union {
+        SIMD::F4 v;
+        struct {
+            float x;
+            float y;
+            float z;
+            float w;
+        };
+        float data[4];
+    };
+};
+
+inline Vec3A operator*(float s, Vec3A u) {
+    return u * s;
+}
+
+/// Take minimum of each lane (the second operand where either is NaN)
+inline Vec3A hmin(Vec3A l, Vec3A r) {
+    return Vec3A(SIMD::min(l.v, r.v));
+}
+
+/// Take maximum of each lane (the second operand where either is NaN)
+inline Vec3A hmax(Vec3A l, Vec3A r) {
+    return Vec3A(SIMD::max(l.v, r.v));
+}
+
+/// Lanes of a where the lanes of mask are negative, and of b elsewhere
+inline Vec3A select(Vec3A mask, Vec3A a, Vec3A b) {
+    return Vec3A(SIMD::select(SIMD::less(mask.v, SIMD::splat(0.0f)), a.v, b.v));
+}
+
+inline std::ostream& operator<<(std::ostream& out, Vec3A v) {
+    out << "{" << v.x << "," << v.y << "," << v.z << "}";
+    return out;
+}
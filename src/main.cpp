@@ -16,13 +16,30 @@ int main(int argc, char** argv) {
     args.add_option("-o,--output", set.output_file, "Image file to write (if headless)");
     args.add_flag("--animate", set.animate, "Output animation frames (if headless)");
     args.add_flag("--no_bvh", set.no_bvh, "Don't use BVH (if headless)");
+    args.add_flag("--wide_bvh", set.wide_bvh, "Use a 4/8-wide SIMD BVH (if headless)");
+    args.add_flag("--wavefront", set.wavefront,
+                  "Trace paths in batches through separate stages (if headless)");
+    args.add_flag("--ray_sort", set.ray_sort,
+                  "Sort secondary rays by origin and direction before tracing (if wavefront)");
     args.add_option("--width", set.w, "Output image width (if headless)");
     args.add_option("--height", set.h, "Output image height (if headless)");
     args.add_flag("--use_ar", set.w_from_ar,
                   "Compute output image width based on camera AR (if headless)");
     args.add_option("--depth", set.d, "Maximum ray depth (if headless)");
+    args.add_option("--rr_depth", set.rr_depth,
+                    "Ray depth after which paths end by Russian roulette (if headless)");
     args.add_option("--samples", set.s, "Pixel samples (if headless)");
     args.add_option("--exposure", set.exp, "Output exposure (if headless)");
+    args.add_option("--adaptive_threshold", set.adaptive_threshold,
+                    "Stop sampling pixels once their relative error is below this (if headless)");
+    args.add_option("--heatmap", set.heatmap_file,
+                    "Image file to write samples per pixel to (if headless)");
+    args.add_option("--sampler", set.sampler,
+                    "Sample sequence: random, halton, or sobol (if headless)")
+        ->check(CLI::IsMember({"random", "halton", "sobol"}));
+    args.add_option("--seed", set.seed, "Random seed of the render (if headless)");
+    args.add_option("--bvh_cache", set.bvh_cache_dir,
+                    "Directory to keep mesh BVHs in between runs (if headless)");
 
     CLI11_PARSE(args, argc, argv);
 
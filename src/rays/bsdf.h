@@ -5,6 +5,7 @@
 
 #include "../lib/mathlib.h"
 #include "../lib/spectrum.h"
+#include "../lib/spectrum4.h"
 #include "../util/hdr_image.h"
 
 #include "samplers.h"
@@ -13,7 +14,7 @@ namespace PT {
 
 struct Scatter {
 
-    Spectrum attenuation;
+    Spectrum4 attenuation;
     Vec3 direction;
 
     void transform(const Mat4& T) {
@@ -27,10 +28,10 @@ struct BSDF_Lambertian {
     }
 
     Scatter scatter(Vec3 out_dir) const;
-    Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const;
+    Spectrum4 evaluate(Vec3 out_dir, Vec3 in_dir) const;
     float pdf(Vec3 out_Dir, Vec3 in_dir) const;
 
-    Spectrum albedo;
+    Spectrum4 albedo;
     Samplers::Hemisphere::Cosine sampler;
 };
 
@@ -41,7 +42,7 @@ struct BSDF_Mirror {
 
     Scatter scatter(Vec3 out_dir) const;
 
-    Spectrum reflectance;
+    Spectrum4 reflectance;
 };
 
 struct BSDF_Refract {
@@ -52,7 +53,7 @@ struct BSDF_Refract {
 
     Scatter scatter(Vec3 out_dir) const;
 
-    Spectrum transmittance;
+    Spectrum4 transmittance;
     float index_of_refraction;
 };
 
@@ -64,8 +65,8 @@ struct BSDF_Glass {
 
     Scatter scatter(Vec3 out_dir) const;
 
-    Spectrum transmittance;
-    Spectrum reflectance;
+    Spectrum4 transmittance;
+    Spectrum4 reflectance;
     float index_of_refraction;
 };
 
@@ -74,13 +75,16 @@ struct BSDF_Diffuse {
     BSDF_Diffuse(Spectrum radiance) : radiance(radiance) {
     }
 
-    Spectrum emissive() const;
+    Spectrum4 emissive() const;
 
-    Spectrum radiance;
+    Spectrum4 radiance;
 };
 
 class BSDF {
 public:
+    using Variant =
+        std::variant<BSDF_Lambertian, BSDF_Mirror, BSDF_Glass, BSDF_Diffuse, BSDF_Refract>;
+
     BSDF(BSDF_Lambertian&& b) : underlying(std::move(b)) {
     }
     BSDF(BSDF_Mirror&& b) : underlying(std::move(b)) {
@@ -105,11 +109,11 @@ public:
                           underlying);
     }
 
-    Spectrum evaluate(Vec3 out_dir, Vec3 in_dir) const {
+    Spectrum4 evaluate(Vec3 out_dir, Vec3 in_dir) const {
         return std::visit(
             overloaded{
                 [out_dir, in_dir](const BSDF_Lambertian& l) { return l.evaluate(out_dir, in_dir); },
-                [](const auto&) -> Spectrum { die("You evaluated a delta BSDF!"); }},
+                [](const auto&) -> Spectrum4 { die("You evaluated a delta BSDF!"); }},
             underlying);
     }
 
@@ -121,9 +125,9 @@ public:
             underlying);
     }
 
-    Spectrum emissive() const {
+    Spectrum4 emissive() const {
         return std::visit(overloaded{[](const BSDF_Diffuse& d) { return d.emissive(); },
-                                     [](const auto& b) { return Spectrum{}; }},
+                                     [](const auto& b) { return Spectrum4{}; }},
                           underlying);
     }
 
@@ -145,8 +149,17 @@ public:
                           underlying);
     }
 
+    // Position of the underlying BSDF in Variant, so work can be grouped by type and then
+    // use get<T>() instead of dispatching on every call
+    size_t type() const {
+        return underlying.index();
+    }
+    template<typename T> const T& get() const {
+        return std::get<T>(underlying);
+    }
+
 private:
-    std::variant<BSDF_Lambertian, BSDF_Mirror, BSDF_Glass, BSDF_Diffuse, BSDF_Refract> underlying;
+    Variant underlying;
 };
 
 } // namespace PT
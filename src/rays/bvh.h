@@ -3,16 +3,21 @@
 
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
+#include "../util/thread_pool.h"
 
 #include "trace.h"
 
 namespace PT {
 
+template<typename Primitive> class MBVH;
+
 template<typename Primitive> class BVH {
 public:
     BVH() = default;
-    BVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1);
-    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1);
+    BVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+        Thread_Pool* pool = nullptr);
+    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+               Thread_Pool* pool = nullptr);
 
     BVH(BVH&& src) = default;
     BVH& operator=(BVH&& src) = default;
@@ -21,7 +26,27 @@ public:
     BVH& operator=(const BVH& src) = delete;
 
     BBox bbox() const;
-    Trace hit(const Ray& ray) const;
+    Hit intersect(const Ray& ray) const;
+    // Traces up to max_packet_size rays at once. hits[i] is replaced whenever rays[i]
+    // finds a closer intersection, so it should start out as a miss or a previous result.
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const;
+    // Whether the ray hits anything within its distance bounds. Stops at the first hit found.
+    bool occluded(const Ray& ray) const;
+
+    // Recomputes node bounds bottom-up after the primitives have moved, keeping the tree
+    // structure. Returns the SAH cost of the refit tree relative to its cost when built.
+    float refit();
+
+    // Calls f(first, count) with the primitives of each leaf, which are contiguous
+    template<typename F> void for_each_leaf(F&& f);
+
+    // A built tree is described by its nodes, as raw bytes, and its primitives in the order
+    // the leaves index them. restore() takes both back instead of building the tree (so that
+    // trees can be cached on disk), and returns false if the nodes are malformed. Only the
+    // structure is taken from the nodes: their bounds are recomputed from the primitives.
+    const void* node_data(size_t& bytes) const;
+    const std::vector<Primitive>& leaf_primitives() const;
+    bool restore(const void* data, size_t bytes, std::vector<Primitive>&& primitives);
 
     BVH copy() const;
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
@@ -33,17 +58,45 @@ private:
     class Node {
 
         BBox bbox;
-        size_t start, size, l, r;
+        // Nodes are stored in depth-first order, so an interior node's left child always
+        // directly follows it. Leaves hold `size` primitives beginning at `start`; interior
+        // nodes have size == 0 and use `start` as the index of their right child.
+        uint32_t start, size;
 
-        // A node is a leaf if l == r, since all interior nodes must have distinct children
         bool is_leaf() const;
+        uint32_t left(uint32_t idx) const;
+        uint32_t right() const;
         friend class BVH<Primitive>;
+        friend class MBVH<Primitive>;
+    };
+
+    // Nodes are first built with explicit children, then flattened into the compact layout
+    struct Build_Node {
+        BBox bbox;
+        size_t start, size, l, r;
     };
     size_t new_node(BBox box = {}, size_t start = 0, size_t size = 0, size_t l = 0, size_t r = 0);
 
+    struct Build_Prim {
+        BBox box;
+        Vec3 center;
+        size_t index;
+    };
+    size_t build_node(std::vector<Build_Prim>& prims, size_t start, size_t size,
+                      size_t max_leaf_size, size_t depth, Thread_Pool* pool);
+    void flatten(size_t root);
+    float sah_cost() const;
+
+    // Subtrees are built in parallel when they hold at least this many primitives
+    static const size_t parallel_threshold = 4096;
+    // Traversal keeps a fixed-size stack, so the builder never makes trees deeper than this
+    static const size_t max_depth = 64;
+
+    std::vector<Build_Node> build_nodes;
     std::vector<Node> nodes;
     std::vector<Primitive> primitives;
-    size_t root_idx = 0;
+    float built_cost = 0.0f;
+    friend class MBVH<Primitive>;
 };
 
 } // namespace PT
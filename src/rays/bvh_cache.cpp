@@ -0,0 +1,243 @@
+#include "bvh_cache.h"
+#include "../lib/log.h"
+#include "tri_mesh.h"
+
+#include <SDL2/SDL.h>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace PT {
+
+namespace {
+
+// Bump when the file layout or the BVH node layout changes, so old files are not read
+const uint32_t format_version = 2;
+const char magic[8] = "S3D-BVH";
+
+// Files start with this header, followed by the BVH nodes and then the index of each leaf
+// triangle within the mesh, in leaf order. It is padded so the nodes stay aligned when mapped.
+struct Header {
+    char magic[8];
+    uint64_t key;
+    uint64_t vertices, triangles, node_bytes;
+    uint64_t reserved[3];
+};
+static_assert(sizeof(Header) == 64, "Cached BVH nodes should be aligned");
+
+// A read-only mapping of a whole file, which is empty if the file could not be mapped
+class Mapped_File {
+public:
+    explicit Mapped_File(const std::string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER size;
+        if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if(!mapping) return;
+        void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if(!view) return;
+        bytes = static_cast<const unsigned char*>(view);
+        length = (size_t)size.QuadPart;
+#else
+        fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) return;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0) return;
+        void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(view == MAP_FAILED) return;
+        bytes = static_cast<const unsigned char*>(view);
+        length = (size_t)st.st_size;
+#endif
+    }
+    ~Mapped_File() {
+#ifdef _WIN32
+        if(bytes) UnmapViewOfFile(bytes);
+        if(mapping) CloseHandle(mapping);
+        if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if(bytes) munmap(const_cast<unsigned char*>(bytes), length);
+        if(fd >= 0) close(fd);
+#endif
+    }
+
+    Mapped_File(const Mapped_File&) = delete;
+    Mapped_File& operator=(const Mapped_File&) = delete;
+
+    const unsigned char* data() const {
+        return bytes;
+    }
+    size_t size() const {
+        return length;
+    }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+};
+
+// The BVH only depends on the positions and indices, and on how it is built
+uint64_t cache_key(const GL::Mesh& mesh, bool wide_bvh) {
+    uint64_t h = 14695981039346656037ull;
+    auto add = [&h](uint32_t word) { h = (h ^ word) * 1099511628211ull; };
+    auto add_float = [&add](float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        add(bits);
+    };
+    add(format_version);
+    add(wide_bvh ? MBVH<Triangle>::width : 2);
+    add((uint32_t)Tri_Mesh::leaf_size);
+    add((uint32_t)mesh.verts().size());
+    for(const auto& v : mesh.verts()) {
+        add_float(v.pos.x), add_float(v.pos.y), add_float(v.pos.z);
+    }
+    for(GL::Mesh::Index i : mesh.indices()) {
+        add(i);
+    }
+    return h;
+}
+
+} // namespace
+
+void BVH_Cache::set_directory(std::string dir) {
+    directory = std::move(dir);
+    if(directory.empty()) return;
+    std::error_code err;
+    std::filesystem::create_directories(directory, err);
+    if(err) {
+        warn("Not caching BVHs: could not create %s (%s)", directory.c_str(),
+             err.message().c_str());
+        directory.clear();
+    }
+}
+
+bool BVH_Cache::enabled() const {
+    return !directory.empty();
+}
+
+std::string BVH_Cache::path(uint64_t key) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+    return (std::filesystem::path(directory) / name).string();
+}
+
+std::shared_ptr<Tri_Mesh> BVH_Cache::build(const GL::Mesh& mesh, bool wide_bvh,
+                                           Thread_Pool* pool) {
+
+    uint64_t key = cache_key(mesh, wide_bvh);
+    std::string file = path(key);
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    auto ret = std::make_shared<Tri_Mesh>();
+    if(load(file, key, mesh, wide_bvh, *ret)) {
+        load_ticks += SDL_GetPerformanceCounter() - start;
+        hits++;
+        return ret;
+    }
+
+    start = SDL_GetPerformanceCounter();
+    ret = std::make_shared<Tri_Mesh>(mesh, true, wide_bvh, pool);
+    build_ticks += SDL_GetPerformanceCounter() - start;
+    misses++;
+
+    if(!save(file, key, mesh, *ret)) failed_writes++;
+    return ret;
+}
+
+bool BVH_Cache::load(const std::string& file, uint64_t key, const GL::Mesh& mesh,
+                     bool wide_bvh, Tri_Mesh& out) const {
+
+    Mapped_File map(file);
+    if(map.size() < sizeof(Header)) return false;
+
+    Header header;
+    std::memcpy(&header, map.data(), sizeof(Header));
+    if(std::memcmp(header.magic, magic, sizeof(magic)) || header.key != key ||
+       header.vertices != mesh.verts().size()) {
+        return false;
+    }
+
+    // Anything else wrong with the contents is caught by Tri_Mesh::restore
+    size_t body = map.size() - sizeof(Header);
+    if(header.node_bytes > body || header.node_bytes % sizeof(uint32_t) ||
+       header.triangles != (body - header.node_bytes) / sizeof(uint32_t) ||
+       (body - header.node_bytes) % sizeof(uint32_t)) {
+        return false;
+    }
+
+    const unsigned char* nodes = map.data() + sizeof(Header);
+    const uint32_t* order = reinterpret_cast<const uint32_t*>(nodes + header.node_bytes);
+    return out.restore(mesh, wide_bvh, nodes, header.node_bytes, order, header.triangles);
+}
+
+bool BVH_Cache::save(const std::string& file, uint64_t key, const GL::Mesh& mesh,
+                     const Tri_Mesh& built) const {
+
+    size_t node_bytes = 0;
+    const void* nodes = built.bvh_nodes(node_bytes);
+    std::vector<uint32_t> order = built.bvh_triangles();
+
+    Header header = {};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.key = key;
+    header.vertices = mesh.verts().size();
+    header.triangles = order.size();
+    header.node_bytes = node_bytes;
+
+    // Written under a temporary name first, so that no other thread or process ever maps a
+    // partly written file. The name is unique to this thread of this process.
+#ifdef _WIN32
+    unsigned long process = GetCurrentProcessId();
+#else
+    unsigned long process = (unsigned long)getpid();
+#endif
+    std::string tmp = file + "." + std::to_string(process) + "." +
+                      std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    FILE* f = std::fopen(tmp.c_str(), "wb");
+    if(!f) return false;
+
+    bool ok = std::fwrite(&header, sizeof(Header), 1, f) == 1 &&
+              std::fwrite(nodes, 1, node_bytes, f) == node_bytes &&
+              std::fwrite(order.data(), sizeof(uint32_t), order.size(), f) == order.size();
+    ok = std::fclose(f) == 0 && ok;
+
+    // Renaming onto an existing file fails on Windows, in which case another render already
+    // cached the same BVH
+    if(ok && std::rename(tmp.c_str(), file.c_str()) == 0) return true;
+    std::remove(tmp.c_str());
+    return ok;
+}
+
+BVH_Cache::Stats BVH_Cache::stats() const {
+    double ms = 1000.0 / SDL_GetPerformanceFrequency();
+    Stats ret;
+    ret.hits = hits;
+    ret.misses = misses;
+    ret.failed_writes = failed_writes;
+    ret.load_ms = load_ticks * ms;
+    ret.build_ms = build_ticks * ms;
+    return ret;
+}
+
+} // namespace PT
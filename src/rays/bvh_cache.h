@@ -0,0 +1,48 @@
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "../platform/gl.h"
+#include "../util/thread_pool.h"
+
+namespace PT {
+
+class Tri_Mesh;
+
+// Keeps the BVHs of triangle meshes in a directory, so that meshes that have not changed
+// since an earlier run are not built again. Each file is named after a hash of the mesh's
+// vertex positions and indices and of the build settings, and is memory mapped to be read.
+class BVH_Cache {
+public:
+    struct Stats {
+        size_t hits = 0, misses = 0, failed_writes = 0;
+        double load_ms = 0.0, build_ms = 0.0;
+    };
+
+    // Caching is off until a directory is set, which is created if it does not exist.
+    // Setting an empty directory turns caching off again.
+    void set_directory(std::string dir);
+    bool enabled() const;
+
+    // Loads the BVH of a mesh from the cache, or builds it and adds it to the cache.
+    // May be called from several threads at once.
+    std::shared_ptr<Tri_Mesh> build(const GL::Mesh& mesh, bool wide_bvh, Thread_Pool* pool);
+
+    Stats stats() const;
+
+private:
+    std::string path(uint64_t key) const;
+    bool load(const std::string& file, uint64_t key, const GL::Mesh& mesh, bool wide_bvh,
+              Tri_Mesh& out) const;
+    bool save(const std::string& file, uint64_t key, const GL::Mesh& mesh,
+              const Tri_Mesh& built) const;
+
+    std::string directory;
+    std::atomic<size_t> hits = 0, misses = 0, failed_writes = 0;
+    std::atomic<uint64_t> load_ticks = 0, build_ticks = 0;
+};
+
+} // namespace PT
@@ -38,18 +38,37 @@ struct Env_Sphere {
     Samplers::Sphere::Uniform sampler;
 };
 
+// The texels of an image stored in square tiles, so that the four texels of a bilinear
+// lookup usually lie within one tile, a few cache lines apart, rather than a whole image
+// row apart.
+struct Tiled_Image {
+
+    Tiled_Image(const HDR_Image& image);
+
+    Spectrum at(size_t x, size_t y) const;
+    // Bilinearly interpolates between texel centers at image coordinates uv. Wraps around
+    // in u and clamps in v, matching an equirectangular map.
+    Spectrum bilinear(Vec2 uv) const;
+    size_t bytes() const;
+
+    static const size_t tile = 4;
+    size_t w = 0, h = 0, tiles_w = 0;
+    std::vector<Spectrum> texels;
+};
+
 struct Env_Map {
 
-    Env_Map(HDR_Image&& img) : image(std::move(img)), image_sampler(image) {
+    // Only keeps the precomputed sampler and tiled radiance, not the image itself
+    Env_Map(HDR_Image&& img) : image_sampler(img), radiance(img) {
     }
 
     Vec3 sample() const;
     Spectrum evaluate(Vec3 dir) const;
     float pdf(Vec3 dir) const;
+    size_t bytes() const;
 
-    HDR_Image image;
-    Samplers::Sphere::Uniform uniform_sampler;
     Samplers::Sphere::Image image_sampler;
+    Tiled_Image radiance;
 };
 
 class Env_Light {
@@ -18,7 +18,7 @@ struct Light_Sample {
     Vec3 direction;
     float distance = 0.0f;
 
-    void transform(const Mat4& T) {
+    void transform(const Affine& T) {
         direction = T.rotate(direction);
     }
 };
@@ -54,16 +54,16 @@ struct Spot_Light {
 class Delta_Light {
 public:
     Delta_Light(Directional_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), underlying(std::move(l)) {
+        has_trans = trans != Affine::I;
     }
     Delta_Light(Point_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), underlying(std::move(l)) {
+        has_trans = trans != Affine::I;
     }
     Delta_Light(Spot_Light&& l, Scene_ID id, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), underlying(std::move(l)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), underlying(std::move(l)) {
+        has_trans = trans != Affine::I;
     }
 
     Delta_Light(const Delta_Light& src) = delete;
@@ -82,14 +82,14 @@ public:
         return _id;
     }
     void set_trans(const Mat4& T) {
-        trans = T;
-        itrans = T.inverse();
-        has_trans = trans != Mat4::I;
+        trans = Affine(T);
+        itrans = trans.inverse();
+        has_trans = trans != Affine::I;
     }
 
 private:
     bool has_trans;
-    Mat4 trans, itrans;
+    Affine trans, itrans;
     Scene_ID _id;
     std::variant<Directional_Light, Point_Light, Spot_Light> underlying;
 };
@@ -0,0 +1,216 @@
+#include "light_tree.h"
+#include "samplers.h"
+
+#include "../util/rand.h"
+
+namespace PT {
+
+Light_Tree::Cone Light_Tree::Cone::merge(Cone a, Cone b) {
+
+    // Any set of two-sided directions fits in a cone of angle pi/2, and flipping b to
+    // face the same way as a keeps the merged cone as narrow as possible.
+    if(dot(a.axis, b.axis) < 0.0f) b.axis = -b.axis;
+
+    float theta_d = std::acos(clamp(dot(a.axis, b.axis), -1.0f, 1.0f));
+    if(theta_d + b.theta <= a.theta) return a;
+    if(theta_d + a.theta <= b.theta) return b;
+
+    float theta = (a.theta + theta_d + b.theta) / 2.0f;
+    Vec3 perp = cross(a.axis, b.axis);
+    if(theta >= PI_F / 2.0f || perp.norm_squared() == 0.0f) return {a.axis, PI_F / 2.0f};
+
+    // Rotate a's axis towards b's until the cone just covers both
+    float rotate = theta - a.theta;
+    Vec3 axis = std::cos(rotate) * a.axis + std::sin(rotate) * cross(perp.unit(), a.axis);
+    return {axis.unit(), theta};
+}
+
+float Light_Tree::Node::importance(Vec3 from) const {
+
+    // Power over squared distance, scaled by the cosine of the smallest angle between
+    // the emitters' normals and the direction to `from` that the bounds allow. Inside the
+    // bounding sphere every direction is possible and the distance is clamped to its
+    // radius.
+    Vec3 to = from - bounds.center();
+    float d2 = to.norm_squared();
+    float r2 = 0.25f * (bounds.max - bounds.min).norm_squared();
+    if(d2 <= r2) return power / std::max(r2, FLT_MIN);
+
+    float d = std::sqrt(d2);
+    float theta = std::acos(clamp(std::abs(dot(normals.axis, to)) / d, 0.0f, 1.0f));
+    float theta_u = std::asin(std::sqrt(r2 / d2));
+    float theta_min = std::max(theta - normals.theta - theta_u, 0.0f);
+    if(theta_min >= PI_F / 2.0f) return 0.0f;
+    return power * std::cos(theta_min) / d2;
+}
+
+void Light_Tree::add(const GL::Mesh& mesh, const Mat4& T, Spectrum radiance) {
+
+    float luma = radiance.luma();
+    if(luma <= 0.0f) return;
+
+    Affine trans(T);
+    const auto& verts = mesh.verts();
+    const auto& idxs = mesh.indices();
+    for(size_t i = 0; i + 2 < idxs.size(); i += 3) {
+        Emitter e;
+        e.v0 = trans * verts[idxs[i]].pos;
+        e.e1 = trans * verts[idxs[i + 1]].pos - e.v0;
+        e.e2 = trans * verts[idxs[i + 2]].pos - e.v0;
+        Vec3 n = cross(e.e1, e.e2);
+        float len = n.norm();
+        if(len == 0.0f) continue;
+        e.normal = n / len;
+        e.area = 0.5f * len;
+        e.power = luma * e.area;
+        emitters.push_back(e);
+    }
+}
+
+void Light_Tree::build() {
+    nodes.clear();
+    if(emitters.empty()) return;
+    nodes.reserve(2 * emitters.size() - 1);
+    build_node(0, emitters.size());
+}
+
+uint32_t Light_Tree::build_node(size_t start, size_t size) {
+
+    uint32_t idx = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    auto center = [](const Emitter& e) { return e.v0 + (e.e1 + e.e2) / 3.0f; };
+
+    Node node;
+    BBox centers;
+    for(size_t i = start; i < start + size; i++) {
+        const Emitter& e = emitters[i];
+        node.bounds.enclose(e.v0);
+        node.bounds.enclose(e.v0 + e.e1);
+        node.bounds.enclose(e.v0 + e.e2);
+        node.power += e.power;
+        Cone cone = {e.normal, 0.0f};
+        node.normals = i == start ? cone : Cone::merge(node.normals, cone);
+        centers.enclose(center(e));
+    }
+
+    if(size == 1) {
+        node.start = (uint32_t)start;
+        node.size = 1;
+        nodes[idx] = node;
+        return idx;
+    }
+
+    // Splitting at the median along the widest axis keeps the tree balanced, so sampling
+    // and pdf queries always visit O(log N) levels.
+    Vec3 extent = centers.max - centers.min;
+    int axis = 0;
+    if(extent.y > extent[axis]) axis = 1;
+    if(extent.z > extent[axis]) axis = 2;
+    size_t mid = start + size / 2;
+    std::nth_element(emitters.begin() + start, emitters.begin() + mid,
+                     emitters.begin() + start + size, [&](const Emitter& a, const Emitter& b) {
+                         return center(a)[axis] < center(b)[axis];
+                     });
+
+    build_node(start, mid - start);
+    node.start = build_node(mid, start + size - mid);
+    nodes[idx] = node;
+    return idx;
+}
+
+void Light_Tree::clear() {
+    emitters.clear();
+    nodes.clear();
+}
+
+bool Light_Tree::empty() const {
+    return nodes.empty();
+}
+
+float Light_Tree::left_probability(const Node& node, uint32_t idx, Vec3 from) const {
+    float l = nodes[idx + 1].importance(from);
+    float r = nodes[node.start].importance(from);
+    if(!(l + r > 0.0f) || !std::isfinite(l + r)) return 0.5f;
+    return l / (l + r);
+}
+
+Vec3 Light_Tree::sample(Vec3 from) const {
+
+    if(nodes.empty()) return {};
+
+    // A single uniform number chooses the whole path: after each choice it is rescaled to
+    // the part of [0,1) that choice covered, which leaves it uniform again.
+    float u = RNG::sample_1D();
+    uint32_t idx = 0;
+    while(nodes[idx].size == 0) {
+        const Node& node = nodes[idx];
+        float p = left_probability(node, idx, from);
+        if(u < p) {
+            u = u / p;
+            idx = idx + 1;
+        } else {
+            u = (u - p) / (1.0f - p);
+            idx = node.start;
+        }
+        u = std::min(u, std::nextafter(1.0f, 0.0f));
+    }
+
+    const Emitter& e = emitters[nodes[idx].start];
+    Samplers::Triangle triangle(e.v0, e.v0 + e.e1, e.v0 + e.e2);
+    return (triangle.sample() - from).unit();
+}
+
+float Light_Tree::emitter_pdf(const Emitter& e, const Ray& ray) const {
+
+    Vec3 e1_d = cross(e.e1, ray.dir);
+    float det = dot(e1_d, e.e2);
+    if(det == 0.0f) return 0.0f;
+
+    Vec3 s = ray.point - e.v0;
+    Vec3 s_e2 = cross(s, e.e2);
+    float u = -dot(s_e2, ray.dir) / det;
+    float v = dot(e1_d, s) / det;
+    float t = -dot(s_e2, e.e1) / det;
+    if(u < 0.0f || v < 0.0f || u + v > 1.0f) return 0.0f;
+    if(t <= ray.dist_bounds.x || t > ray.dist_bounds.y) return 0.0f;
+
+    // Convert the uniform area density to solid angle
+    return t * t / (e.area * std::abs(dot(e.normal, ray.dir)));
+}
+
+float Light_Tree::pdf(const Ray& ray) const {
+
+    if(nodes.empty()) return 0.0f;
+
+    // A direction may pass through several emitters, each of which could have produced
+    // it. Only subtrees whose bounds the ray enters can contain one, and the probability
+    // of choosing each is accumulated on the way down.
+    // The tree is balanced, so a fixed stack is deep enough for any number of emitters.
+    Traversal_Ray tray(ray);
+    std::pair<uint32_t, float> stack[64];
+    size_t top = 0;
+    stack[top++] = {0, 1.0f};
+
+    float ret = 0.0f;
+    while(top > 0) {
+
+        auto [idx, prob] = stack[--top];
+
+        const Node& node = nodes[idx];
+        Vec2 times = ray.dist_bounds;
+        if(!node.bounds.hit(tray, times)) continue;
+
+        if(node.size) {
+            ret += prob * emitter_pdf(emitters[node.start], ray);
+            continue;
+        }
+
+        float p = left_probability(node, idx, ray.point);
+        if(p > 0.0f) stack[top++] = {idx + 1, prob * p};
+        if(p < 1.0f) stack[top++] = {node.start, prob * (1.0f - p)};
+    }
+    return ret;
+}
+
+} // namespace PT
@@ -0,0 +1,71 @@
+
+#pragma once
+
+#include <vector>
+
+#include "../lib/mathlib.h"
+#include "../platform/gl.h"
+
+namespace PT {
+
+// Importance samples the emissive triangles of the scene, after "Importance Sampling of
+// Many Lights with Adaptive Tree Splitting" (Conty Estevez & Kulla 2018). Each node of a
+// binary tree bounds the position, total power and normal directions of its emitters, so
+// picking a light walks down the tree choosing each child in proportion to a cheap
+// estimate of its contribution to the shading point. Sampling and pdf evaluation both
+// take O(log N) for N emitters. Emitters are two-sided, like BSDF_Diffuse.
+class Light_Tree {
+public:
+    Light_Tree() = default;
+
+    Light_Tree(Light_Tree&& src) = default;
+    Light_Tree& operator=(Light_Tree&& src) = default;
+    Light_Tree(const Light_Tree& src) = delete;
+    Light_Tree& operator=(const Light_Tree& src) = delete;
+
+    // Adds the triangles of a mesh, moved to world space by T, emitting radiance.
+    // Takes effect at the next build().
+    void add(const GL::Mesh& mesh, const Mat4& T, Spectrum radiance);
+    void build();
+    void clear();
+    bool empty() const;
+
+    // Returns a world-space direction from `from` towards a point on a light
+    Vec3 sample(Vec3 from) const;
+    // Solid angle density with which sample(ray.point) returns ray.dir
+    float pdf(const Ray& ray) const;
+
+private:
+    struct Emitter {
+        Vec3 v0, e1, e2, normal;
+        float area = 0.0f, power = 0.0f;
+    };
+
+    // A cone of directions: those within angle theta of axis
+    struct Cone {
+        Vec3 axis;
+        float theta = 0.0f;
+        // Emitters are two-sided, so a cone and its reflection are equivalent
+        static Cone merge(Cone a, Cone b);
+    };
+
+    struct Node {
+        BBox bounds;
+        Cone normals;
+        float power = 0.0f;
+        // Leaves (size == 1) hold the emitter at index start. Interior nodes have
+        // size == 0, their left child directly follows them and start is the right child.
+        uint32_t start = 0, size = 0;
+
+        float importance(Vec3 from) const;
+    };
+
+    uint32_t build_node(size_t start, size_t size);
+    float left_probability(const Node& node, uint32_t idx, Vec3 from) const;
+    float emitter_pdf(const Emitter& e, const Ray& ray) const;
+
+    std::vector<Emitter> emitters;
+    std::vector<Node> nodes;
+};
+
+} // namespace PT
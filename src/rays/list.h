@@ -22,15 +22,27 @@ public:
         return ret;
     }
 
-    Trace hit(const Ray& ray) const {
-        Trace ret;
+    Hit intersect(const Ray& ray) const {
+        Hit ret;
         for(const auto& p : prims) {
-            Trace test = p.hit(ray);
-            ret = Trace::min(ret, test);
+            ret = Hit::min(ret, p.intersect(ray));
         }
         return ret;
     }
 
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+        for(const auto& p : prims) {
+            p.intersect_packet(rays, hits, n);
+        }
+    }
+
+    bool occluded(const Ray& ray) const {
+        for(const auto& p : prims) {
+            if(p.occluded(ray)) return true;
+        }
+        return false;
+    }
+
     void append(Primitive&& prim) {
         prims.push_back(std::move(prim));
     }
@@ -42,11 +54,11 @@ public:
 
     Vec3 sample(Vec3 from) const {
         if(prims.empty()) return {};
-        int n = RNG::integer(0, (int)prims.size());
+        size_t n = std::min((size_t)(RNG::sample_1D() * prims.size()), prims.size() - 1);
         return prims[n].sample(from);
     }
 
-    float pdf(Ray ray, const Mat4& T = Mat4::I, const Mat4& iT = Mat4::I) const {
+    float pdf(Ray ray, const Affine& T = Affine::I, const Affine& iT = Affine::I) const {
         if(prims.empty()) return 0.0f;
         float ret = 0.0f;
         for(auto& prim : prims) ret += prim.pdf(ray, T, iT);
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "../lib/mathlib.h"
+#include "../platform/gl.h"
+
+#include "bvh.h"
+#include "trace.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define MBVH_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MBVH_SSE
+#endif
+
+namespace PT {
+
+// A wide BVH: the binary BVH collapsed into nodes with up to MBVH_WIDTH children, whose
+// bounds are stored as structure-of-arrays so one ray is tested against every child of
+// a node at once. Built from (and traversed like) a BVH over the same primitive type.
+template<typename Primitive> class MBVH {
+public:
+#ifdef MBVH_AVX
+    static const int width = 8;
+#else
+    static const int width = 4;
+#endif
+
+    MBVH() = default;
+    MBVH(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+         Thread_Pool* pool = nullptr);
+    void build(std::vector<Primitive>&& primitives, size_t max_leaf_size = 1,
+               Thread_Pool* pool = nullptr);
+
+    MBVH(MBVH&& src) = default;
+    MBVH& operator=(MBVH&& src) = default;
+
+    MBVH(const MBVH& src) = delete;
+    MBVH& operator=(const MBVH& src) = delete;
+
+    BBox bbox() const;
+    Hit intersect(const Ray& ray) const;
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const;
+    bool occluded(const Ray& ray) const;
+
+    float refit();
+
+    template<typename F> void for_each_leaf(F&& f);
+
+    // As for BVH
+    const void* node_data(size_t& bytes) const;
+    const std::vector<Primitive>& leaf_primitives() const;
+    bool restore(const void* data, size_t bytes, std::vector<Primitive>&& primitives);
+
+    MBVH copy() const;
+    size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
+
+    std::vector<Primitive> destructure();
+    void clear();
+
+private:
+    struct alignas(32) Node {
+        float min_x[width], min_y[width], min_z[width];
+        float max_x[width], max_y[width], max_z[width];
+        // Leaf children hold count > 0 primitives beginning at child; interior children
+        // have count == 0 and index another node. Unused slots get an empty box.
+        uint32_t child[width];
+        uint32_t count[width];
+    };
+
+    void collapse(const BVH<Primitive>& bvh);
+    uint32_t collapse_node(const BVH<Primitive>& bvh, uint32_t idx);
+    BBox node_bbox(const Node& node) const;
+    float sah_cost() const;
+    int intersect(const Node& node, const Traversal_Ray& ray, Vec2 bounds,
+                  float (&times)[width]) const;
+
+    std::vector<Node> nodes;
+    std::vector<Primitive> primitives;
+    BBox box;
+    float built_cost = 0.0f;
+};
+
+} // namespace PT
+
+#include "mbvh.inl"
@@ -0,0 +1,460 @@
+#include "mbvh.h"
+#include <algorithm>
+#include <cstring>
+#include <stack>
+
+namespace PT {
+
+template<typename Primitive>
+MBVH<Primitive>::MBVH(std::vector<Primitive>&& prims, size_t max_leaf_size, Thread_Pool* pool) {
+    build(std::move(prims), max_leaf_size, pool);
+}
+
+template<typename Primitive>
+void MBVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size,
+                            Thread_Pool* pool) {
+    BVH<Primitive> bvh(std::move(prims), max_leaf_size, pool);
+    collapse(bvh);
+    primitives = std::move(bvh.primitives);
+    built_cost = sah_cost();
+}
+
+template<typename Primitive> void MBVH<Primitive>::collapse(const BVH<Primitive>& bvh) {
+    nodes.clear();
+    box = bvh.bbox();
+    if(bvh.nodes.empty()) return;
+    collapse_node(bvh, 0);
+}
+
+template<typename Primitive>
+uint32_t MBVH<Primitive>::collapse_node(const BVH<Primitive>& bvh, uint32_t idx) {
+
+    // Pull grandchildren up into this node until it is full, always opening the
+    // interior child with the largest surface area first.
+    uint32_t kids[width];
+    int n = 0;
+
+    const auto& root = bvh.nodes[idx];
+    if(root.is_leaf()) {
+        kids[n++] = idx;
+    } else {
+        kids[n++] = root.left(idx);
+        kids[n++] = root.right();
+    }
+
+    while(n < width) {
+        int open = -1;
+        float open_area = -1.0f;
+        for(int i = 0; i < n; i++) {
+            const auto& kid = bvh.nodes[kids[i]];
+            float area = kid.bbox.surface_area();
+            if(!kid.is_leaf() && area > open_area) {
+                open = i;
+                open_area = area;
+            }
+        }
+        if(open < 0) break;
+        const auto& kid = bvh.nodes[kids[open]];
+        uint32_t l = kid.left(kids[open]), r = kid.right();
+        kids[open] = l;
+        kids[n++] = r;
+    }
+
+    uint32_t node_idx = (uint32_t)nodes.size();
+    nodes.emplace_back();
+
+    for(int i = 0; i < width; i++) {
+
+        BBox child_box;
+        uint32_t child = 0, count = 0;
+
+        if(i < n) {
+            const auto& kid = bvh.nodes[kids[i]];
+            child_box = kid.bbox;
+            if(kid.is_leaf()) {
+                child = kid.start;
+                count = kid.size;
+            } else {
+                child = collapse_node(bvh, kids[i]);
+            }
+        }
+
+        Node& node = nodes[node_idx];
+        node.min_x[i] = child_box.min.x;
+        node.min_y[i] = child_box.min.y;
+        node.min_z[i] = child_box.min.z;
+        node.max_x[i] = child_box.max.x;
+        node.max_y[i] = child_box.max.y;
+        node.max_z[i] = child_box.max.z;
+        node.child[i] = i < n ? child : UINT32_MAX;
+        node.count[i] = count;
+    }
+    return node_idx;
+}
+
+template<typename Primitive>
+int MBVH<Primitive>::intersect(const Node& node, const Traversal_Ray& ray, Vec2 bounds,
+                               float (&times)[width]) const {
+
+    // Slab test against every child box at once. Returns a bitmask of the children hit
+    // and writes their entry distances to times. The ray's direction signs pick which
+    // side of each slab is near. Min/max take the running interval as their second
+    // operand, which is what SSE/AVX return when the other one is NaN.
+    const float* lo[3] = {node.min_x, node.min_y, node.min_z};
+    const float* hi[3] = {node.max_x, node.max_y, node.max_z};
+    const float* near[3];
+    const float* far[3];
+    for(int a = 0; a < 3; a++) {
+        near[a] = ray.sign[a] ? hi[a] : lo[a];
+        far[a] = ray.sign[a] ? lo[a] : hi[a];
+    }
+#if defined(MBVH_AVX)
+    __m256 tmin = _mm256_set1_ps(bounds.x);
+    __m256 tmax = _mm256_set1_ps(bounds.y);
+    for(int a = 0; a < 3; a++) {
+        __m256 vo = _mm256_set1_ps(ray.point[a]), vi = _mm256_set1_ps(ray.inv_dir[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near[a]), vo), vi);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far[a]), vo), vi);
+        tmin = _mm256_max_ps(t0, tmin);
+        tmax = _mm256_min_ps(t1, tmax);
+    }
+    _mm256_storeu_ps(times, tmin);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ));
+#elif defined(MBVH_SSE)
+    __m128 tmin = _mm_set1_ps(bounds.x);
+    __m128 tmax = _mm_set1_ps(bounds.y);
+    for(int a = 0; a < 3; a++) {
+        __m128 vo = _mm_set1_ps(ray.point[a]), vi = _mm_set1_ps(ray.inv_dir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near[a]), vo), vi);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far[a]), vo), vi);
+        tmin = _mm_max_ps(t0, tmin);
+        tmax = _mm_min_ps(t1, tmax);
+    }
+    _mm_storeu_ps(times, tmin);
+    return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+    int mask = 0;
+    for(int i = 0; i < width; i++) {
+        float tmin = bounds.x, tmax = bounds.y;
+        for(int a = 0; a < 3; a++) {
+            float t0 = (near[a][i] - ray.point[a]) * ray.inv_dir[a];
+            float t1 = (far[a][i] - ray.point[a]) * ray.inv_dir[a];
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+        }
+        times[i] = tmin;
+        if(tmin <= tmax) mask |= 1 << i;
+    }
+    return mask;
+#endif
+}
+
+template<typename Primitive> Hit MBVH<Primitive>::intersect(const Ray& ray) const {
+
+    Hit ret;
+    if(nodes.empty()) return ret;
+
+    Traversal_Ray tray(ray);
+
+    // Entries are either nodes (count == 0) or leaf primitive ranges, tagged with the
+    // distance at which the ray enters them. Each node pushes at most width entries
+    // and the tree is no deeper than the binary BVH it came from.
+    struct Entry {
+        uint32_t child, count;
+        float t;
+    };
+    Entry stack[64 * width];
+    size_t top = 0;
+    stack[top++] = {0, 0, ray.dist_bounds.x};
+
+    while(top > 0) {
+
+        Entry e = stack[--top];
+        if(ret.hit && e.t > ret.distance) continue;
+
+        if(e.count) {
+            trace_stats.primitives += e.count;
+            intersect_leaf(&primitives[e.child], e.count, ray, ret);
+            continue;
+        }
+
+        const Node& node = nodes[e.child];
+        trace_stats.nodes++;
+
+        Vec2 bounds = ray.dist_bounds;
+        if(ret.hit) bounds.y = std::min(bounds.y, ret.distance);
+
+        alignas(32) float times[width];
+        int mask = intersect(node, tray, bounds, times);
+
+        // Sort the children that were hit far-to-near, so the nearest is popped first
+        Entry hits[width];
+        int n = 0;
+        for(int i = 0; i < width; i++) {
+            if(!(mask & (1 << i)) || node.child[i] == UINT32_MAX) continue;
+            Entry h = {node.child[i], node.count[i], times[i]};
+            int j = n++;
+            for(; j > 0 && hits[j - 1].t < h.t; j--) hits[j] = hits[j - 1];
+            hits[j] = h;
+        }
+        for(int i = 0; i < n; i++) stack[top++] = hits[i];
+    }
+    return ret;
+}
+
+template<typename Primitive> bool MBVH<Primitive>::occluded(const Ray& ray) const {
+
+    if(nodes.empty()) return false;
+
+    Traversal_Ray tray(ray);
+
+    // As in hit(), but children are pushed unsorted and the first primitive hit ends the
+    // traversal.
+    struct Entry {
+        uint32_t child, count;
+    };
+    Entry stack[64 * width];
+    size_t top = 0;
+    stack[top++] = {0, 0};
+
+    while(top > 0) {
+
+        Entry e = stack[--top];
+
+        if(e.count) {
+            trace_stats.primitives += e.count;
+            if(occluded_leaf(&primitives[e.child], e.count, ray)) return true;
+            continue;
+        }
+
+        const Node& node = nodes[e.child];
+        trace_stats.nodes++;
+
+        alignas(32) float times[width];
+        int mask = intersect(node, tray, ray.dist_bounds, times);
+        for(int i = 0; i < width; i++) {
+            if(!(mask & (1 << i)) || node.child[i] == UINT32_MAX) continue;
+            stack[top++] = {node.child[i], node.count[i]};
+        }
+    }
+    return false;
+}
+
+template<typename Primitive>
+void MBVH<Primitive>::intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+    // Wide nodes already test a ray against several boxes at once, so packets are
+    // traversed one ray at a time.
+    intersect_each(*this, rays, hits, n);
+}
+
+template<typename Primitive> BBox MBVH<Primitive>::node_bbox(const Node& node) const {
+    BBox ret;
+    for(int i = 0; i < width; i++) {
+        if(node.child[i] == UINT32_MAX) continue;
+        ret.enclose(BBox(Vec3(node.min_x[i], node.min_y[i], node.min_z[i]),
+                         Vec3(node.max_x[i], node.max_y[i], node.max_z[i])));
+    }
+    return ret;
+}
+
+template<typename Primitive> float MBVH<Primitive>::refit() {
+
+    if(nodes.empty()) return 1.0f;
+
+    // Collapsing emits each node before its children, so a reverse sweep has already
+    // updated every child node by the time its parent reads it.
+    for(size_t n = nodes.size(); n-- > 0;) {
+        Node& node = nodes[n];
+        for(int i = 0; i < width; i++) {
+            if(node.child[i] == UINT32_MAX) continue;
+            BBox child_box;
+            if(node.count[i]) {
+                for(uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+                    child_box.enclose(primitives[p].bbox());
+                }
+            } else {
+                child_box = node_bbox(nodes[node.child[i]]);
+            }
+            node.min_x[i] = child_box.min.x;
+            node.min_y[i] = child_box.min.y;
+            node.min_z[i] = child_box.min.z;
+            node.max_x[i] = child_box.max.x;
+            node.max_y[i] = child_box.max.y;
+            node.max_z[i] = child_box.max.z;
+        }
+    }
+    box = node_bbox(nodes[0]);
+
+    if(built_cost <= 0.0f) return 1.0f;
+    return sah_cost() / built_cost;
+}
+
+template<typename Primitive> float MBVH<Primitive>::sah_cost() const {
+
+    // Same cost model as BVH::sah_cost, counting one traversal step per wide node
+    float root_area = box.surface_area();
+    if(nodes.empty() || root_area <= 0.0f) return 0.0f;
+
+    float cost = 0.0f;
+    for(const Node& node : nodes) {
+        cost += node_bbox(node).surface_area();
+        for(int i = 0; i < width; i++) {
+            if(node.child[i] == UINT32_MAX || !node.count[i]) continue;
+            BBox leaf(Vec3(node.min_x[i], node.min_y[i], node.min_z[i]),
+                      Vec3(node.max_x[i], node.max_y[i], node.max_z[i]));
+            cost += leaf.surface_area() * node.count[i];
+        }
+    }
+    return cost / root_area;
+}
+
+template<typename Primitive> BBox MBVH<Primitive>::bbox() const {
+    return box;
+}
+
+template<typename Primitive> MBVH<Primitive> MBVH<Primitive>::copy() const {
+    MBVH<Primitive> ret;
+    ret.nodes = nodes;
+    ret.primitives = primitives;
+    ret.box = box;
+    ret.built_cost = built_cost;
+    return ret;
+}
+
+template<typename Primitive> template<typename F> void MBVH<Primitive>::for_each_leaf(F&& f) {
+    for(const Node& node : nodes) {
+        for(int i = 0; i < width; i++) {
+            if(node.count[i]) f(&primitives[node.child[i]], (size_t)node.count[i]);
+        }
+    }
+}
+
+template<typename Primitive> const void* MBVH<Primitive>::node_data(size_t& bytes) const {
+    bytes = nodes.size() * sizeof(Node);
+    return nodes.data();
+}
+
+template<typename Primitive>
+const std::vector<Primitive>& MBVH<Primitive>::leaf_primitives() const {
+    return primitives;
+}
+
+template<typename Primitive>
+bool MBVH<Primitive>::restore(const void* data, size_t bytes, std::vector<Primitive>&& prims) {
+
+    clear();
+    if(bytes % sizeof(Node) || (bytes == 0) != prims.empty()) return false;
+
+    std::vector<Node> loaded(bytes / sizeof(Node));
+    std::memcpy(loaded.data(), data, bytes);
+
+    // The same checks as BVH::restore, for every used slot, and the bounds are recomputed too
+    std::vector<bool> reached(loaded.size(), false), covered(prims.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack;
+    if(!loaded.empty()) stack.push_back({0, 0});
+    while(!stack.empty()) {
+        auto [i, depth] = stack.back();
+        stack.pop_back();
+        if(reached[i] || depth >= BVH<Primitive>::max_depth) return false;
+        reached[i] = true;
+
+        const Node& node = loaded[i];
+        for(int c = 0; c < width; c++) {
+            uint32_t child = node.child[c];
+            if(child == UINT32_MAX) continue;
+            if(node.count[c]) {
+                if((size_t)child + node.count[c] > prims.size()) return false;
+                for(size_t p = child; p < (size_t)child + node.count[c]; p++) {
+                    if(covered[p]) return false;
+                    covered[p] = true;
+                }
+            } else {
+                if(child <= i || child >= loaded.size()) return false;
+                stack.push_back({child, depth + 1});
+            }
+        }
+    }
+    if(std::find(reached.begin(), reached.end(), false) != reached.end() ||
+       std::find(covered.begin(), covered.end(), false) != covered.end()) {
+        return false;
+    }
+
+    nodes = std::move(loaded);
+    primitives = std::move(prims);
+    refit();
+    built_cost = sah_cost();
+    return true;
+}
+
+template<typename Primitive> std::vector<Primitive> MBVH<Primitive>::destructure() {
+    nodes.clear();
+    box.reset();
+    built_cost = 0.0f;
+    return std::move(primitives);
+}
+
+template<typename Primitive> void MBVH<Primitive>::clear() {
+    nodes.clear();
+    primitives.clear();
+    box.reset();
+    built_cost = 0.0f;
+}
+
+template<typename Primitive>
+size_t MBVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
+                                  const Mat4& trans) const {
+
+    std::stack<std::pair<uint32_t, size_t>> tstack;
+    size_t max_level = 0;
+
+    if(nodes.empty()) return max_level;
+    tstack.push({0, 0});
+
+    while(!tstack.empty()) {
+
+        auto [idx, lvl] = tstack.top();
+        max_level = std::max(max_level, lvl);
+        const Node& node = nodes[idx];
+        tstack.pop();
+
+        Vec3 color = lvl == level ? Vec3(1.0f, 0.0f, 0.0f) : Vec3(1.0f);
+        GL::Lines& add = lvl == level ? active : lines;
+
+        for(int i = 0; i < width; i++) {
+
+            if(node.child[i] == UINT32_MAX) continue;
+
+            BBox box(Vec3(node.min_x[i], node.min_y[i], node.min_z[i]),
+                     Vec3(node.max_x[i], node.max_y[i], node.max_z[i]));
+            box.transform(trans);
+            Vec3 min = box.min, max = box.max;
+
+            auto edge = [&](Vec3 a, Vec3 b) { add.add(a, b, color); };
+
+            edge(min, Vec3{max.x, min.y, min.z});
+            edge(min, Vec3{min.x, max.y, min.z});
+            edge(min, Vec3{min.x, min.y, max.z});
+            edge(max, Vec3{min.x, max.y, max.z});
+            edge(max, Vec3{max.x, min.y, max.z});
+            edge(max, Vec3{max.x, max.y, min.z});
+            edge(Vec3{min.x, max.y, min.z}, Vec3{max.x, max.y, min.z});
+            edge(Vec3{min.x, max.y, min.z}, Vec3{min.x, max.y, max.z});
+            edge(Vec3{min.x, min.y, max.z}, Vec3{max.x, min.y, max.z});
+            edge(Vec3{min.x, min.y, max.z}, Vec3{min.x, max.y, max.z});
+            edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, max.y, min.z});
+            edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, min.y, max.z});
+
+            if(node.count[i] == 0) {
+                tstack.push({node.child[i], lvl + 1});
+            } else {
+                for(uint32_t p = node.child[i]; p < node.child[i] + node.count[i]; p++) {
+                    size_t c = primitives[p].visualize(lines, active, level - lvl, trans);
+                    max_level = std::max(c + lvl, max_level);
+                }
+            }
+        }
+    }
+    return max_level;
+}
+
+} // namespace PT
@@ -7,6 +7,7 @@
 
 #include "bvh.h"
 #include "list.h"
+#include "mbvh.h"
 #include "shapes.h"
 #include "trace.h"
 #include "tri_mesh.h"
@@ -16,29 +17,41 @@ namespace PT {
 class Object {
 public:
     Object(Shape&& shape, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(shape)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), material(m), underlying(std::move(shape)) {
+        has_trans = trans != Affine::I;
     }
     Object(Tri_Mesh&& tri_mesh, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(tri_mesh)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), material(m), underlying(std::move(tri_mesh)) {
+        has_trans = trans != Affine::I;
+    }
+    Object(Tri_Mesh_Instance&& instance, Scene_ID id, unsigned int m = 0,
+           const Mat4& T = Mat4::I)
+        : trans(T), itrans(trans.inverse()), _id(id), material(m), underlying(std::move(instance)) {
+        has_trans = trans != Affine::I;
     }
     Object(List<Object>&& list, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(list)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), material(m), underlying(std::move(list)) {
+        has_trans = trans != Affine::I;
     }
     Object(BVH<Object>&& bvh, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), _id(id), material(m), underlying(std::move(bvh)) {
-        has_trans = trans != Mat4::I;
+        : trans(T), itrans(trans.inverse()), _id(id), material(m), underlying(std::move(bvh)) {
+        has_trans = trans != Affine::I;
+    }
+    Object(MBVH<Object>&& mbvh, Scene_ID id, unsigned int m = 0, const Mat4& T = Mat4::I)
+        : trans(T), itrans(trans.inverse()), _id(id), material(m), underlying(std::move(mbvh)) {
+        has_trans = trans != Affine::I;
     }
 
     Object() {
     }
     Object(List<Object>&& list, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), underlying(std::move(list)) {
+        : trans(T), itrans(trans.inverse()), underlying(std::move(list)) {
     }
     Object(BVH<Object>&& bvh, const Mat4& T = Mat4::I)
-        : trans(T), itrans(T.inverse()), underlying(std::move(bvh)) {
+        : trans(T), itrans(trans.inverse()), underlying(std::move(bvh)) {
+    }
+    Object(MBVH<Object>&& mbvh, const Mat4& T = Mat4::I)
+        : trans(T), itrans(trans.inverse()), underlying(std::move(mbvh)) {
     }
 
     Object(const Object& src) = delete;
@@ -52,22 +65,90 @@ public:
         return box;
     }
 
-    Trace hit(Ray ray) const {
-        if(has_trans) ray.transform(itrans);
-        Trace ret = std::visit([&ray](const auto& o) { return o.hit(ray); }, underlying);
-        if(ret.hit) {
-            if(material != -1) ret.material = material;
-            if(has_trans) ret.transform(trans, itrans.T());
+    Trace hit(const Ray& ray) const {
+        return finalize(intersect(ray), ray);
+    }
+
+    // Finds the closest hit along the ray without computing its position or normal.
+    // Rays are moved into object space without renormalizing their direction, so hit
+    // distances are the same in both spaces and need no conversion.
+    Hit intersect(const Ray& ray) const {
+        Ray local = to_local(ray);
+        Hit ret = std::visit([&local](const auto& o) { return o.intersect(local); }, underlying);
+        if(ret.hit && !ret.instance) ret.instance = this;
+        return ret;
+    }
+
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+        // Clamp each ray to the closest hit found so far before moving it into object
+        // space, so the underlying traversal can cull everything behind it.
+        Ray local[max_packet_size];
+        Hit found[max_packet_size];
+        for(size_t i = 0; i < n; i++) {
+            local[i] = to_local(rays[i]);
+            if(hits[i].hit) {
+                local[i].dist_bounds.y = std::min(local[i].dist_bounds.y, hits[i].distance);
+            }
+        }
+        std::visit([&](const auto& o) { o.intersect_packet(local, found, n); }, underlying);
+        for(size_t i = 0; i < n; i++) {
+            if(found[i].hit && !found[i].instance) found[i].instance = this;
+            hits[i] = Hit::min(hits[i], found[i]);
+        }
+    }
+
+    // Computes the full Trace for a hit returned by intersect on the same ray. Scenes
+    // nest at most one aggregate of objects, so a hit inside one is finalized directly
+    // by the object that was hit, in this object's space.
+    Trace finalize(const Hit& hit, const Ray& ray) const {
+        if(!hit.hit) return {};
+        Ray local = to_local(ray);
+        Trace ret = std::visit(
+            overloaded{[&](const BVH<Object>&) { return hit.instance->finalize(hit, local); },
+                       [&](const MBVH<Object>&) { return hit.instance->finalize(hit, local); },
+                       [&](const List<Object>&) { return hit.instance->finalize(hit, local); },
+                       [&](const auto& o) { return o.finalize(hit, local); }},
+            underlying);
+        if(material != -1) ret.material = material;
+        if(has_trans) {
+            ret.position = trans * ret.position;
+            ret.normal = itrans.rotate_transposed(ret.normal).unit();
         }
+        ret.origin = ray.point;
+        ret.distance = hit.distance;
         return ret;
     }
 
+    // The material finalize would report for a hit, without computing the rest of the Trace
+    int material_of(const Hit& hit) const {
+        if(material != -1) return material;
+        if(!hit.instance || hit.instance == this) return Trace{}.material;
+        return hit.instance->material_of(hit);
+    }
+
+    void hit_packet(const Ray* rays, Trace* traces, size_t n) const {
+        Hit hits[max_packet_size];
+        intersect_packet(rays, hits, n);
+        for(size_t i = 0; i < n; i++) traces[i] = finalize(hits[i], rays[i]);
+    }
+
+    bool occluded(const Ray& ray) const {
+        Ray local = to_local(ray);
+        return std::visit([&local](const auto& o) { return o.occluded(local); }, underlying);
+    }
+
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, Mat4 vtrans) const {
-        if(has_trans) vtrans = vtrans * trans;
+        if(has_trans) vtrans = vtrans * trans.mat4();
         return std::visit(
             overloaded{
                 [&](const BVH<Object>& bvh) { return bvh.visualize(lines, active, level, vtrans); },
+                [&](const MBVH<Object>& mbvh) {
+                    return mbvh.visualize(lines, active, level, vtrans);
+                },
                 [&](const Tri_Mesh& mesh) { return mesh.visualize(lines, active, level, vtrans); },
+                [&](const Tri_Mesh_Instance& instance) {
+                    return instance.visualize(lines, active, level, vtrans);
+                },
                 [](const auto&) { return size_t(0); }},
             underlying);
     }
@@ -77,6 +158,9 @@ public:
         Vec3 dir =
             std::visit(overloaded{[from](const List<Object>& list) { return list.sample(from); },
                                   [from](const Tri_Mesh& mesh) { return mesh.sample(from); },
+                                  [from](const Tri_Mesh_Instance& instance) {
+                                      return instance.sample(from);
+                                  },
                                   [](const auto&) -> Vec3 {
                                       die("Sampling implicit objects/BVHs is not yet supported.");
                                   }},
@@ -85,7 +169,7 @@ public:
         return dir;
     }
 
-    float pdf(Ray ray, Mat4 T = Mat4::I, Mat4 iT = Mat4::I) const {
+    float pdf(Ray ray, Affine T = Affine::I, Affine iT = Affine::I) const {
         if(has_trans) {
             T = T * trans;
             iT = itrans * iT;
@@ -93,6 +177,9 @@ public:
         return std::visit(
             overloaded{[ray, T, iT](const List<Object>& list) { return list.pdf(ray, T, iT); },
                        [ray, T, iT](const Tri_Mesh& mesh) { return mesh.pdf(ray, T, iT); },
+                       [ray, T, iT](const Tri_Mesh_Instance& instance) {
+                           return instance.pdf(ray, T, iT);
+                       },
                        [](const auto&) -> float {
                            die("Sampling implicit objects/BVHs is not yet supported.");
                        }},
@@ -103,17 +190,26 @@ public:
         return _id;
     }
     void set_trans(const Mat4& T) {
-        trans = T;
-        itrans = T.inverse();
-        has_trans = trans != Mat4::I;
+        trans = Affine(T);
+        itrans = trans.inverse();
+        has_trans = trans != Affine::I;
     }
 
 private:
-    bool has_trans;
-    Mat4 trans, itrans;
+    Ray to_local(const Ray& ray) const {
+        if(!has_trans) return ray;
+        Ray local = ray;
+        local.point = itrans * ray.point;
+        local.dir = itrans.rotate(ray.dir);
+        return local;
+    }
+
+    bool has_trans = false;
+    Affine trans, itrans;
     int material = -1;
-    Scene_ID _id;
-    std::variant<Tri_Mesh, Shape, BVH<Object>, List<Object>> underlying;
+    Scene_ID _id = 0;
+    std::variant<Tri_Mesh, Tri_Mesh_Instance, Shape, BVH<Object>, MBVH<Object>, List<Object>>
+        underlying;
 };
 
 } // namespace PT
\ No newline at end of file
@@ -4,16 +4,46 @@
 #include "../gui/render.h"
 
 #include <SDL2/SDL.h>
+#include <cstring>
 #include <thread>
 
 namespace PT {
 
+static size_t mesh_hash(const GL::Mesh& mesh) {
+    uint64_t h = 14695981039346656037ull;
+    auto add = [&h](float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        h = (h ^ bits) * 1099511628211ull;
+    };
+    for(const auto& v : mesh.verts()) {
+        add(v.pos.x), add(v.pos.y), add(v.pos.z);
+        add(v.norm.x), add(v.norm.y), add(v.norm.z);
+    }
+    for(GL::Mesh::Index i : mesh.indices()) {
+        h = (h ^ i) * 1099511628211ull;
+    }
+    return (size_t)h;
+}
+
+static bool same_mesh(const GL::Mesh& a, const GL::Mesh& b) {
+    if(a.indices() != b.indices() || a.verts().size() != b.verts().size()) return false;
+    for(size_t i = 0; i < a.verts().size(); i++) {
+        const auto &va = a.verts()[i], &vb = b.verts()[i];
+        if(va.pos != vb.pos || va.norm != vb.norm) return false;
+    }
+    return true;
+}
+
 Pathtracer::Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim)
-    : thread_pool(std::thread::hardware_concurrency()), gui(gui), camera(screen_dim),
+    : thread_pool(std::thread::hardware_concurrency()), gui(gui),
+      tile_queues(std::max(std::thread::hardware_concurrency(), 1u)), camera(screen_dim),
       scene(List<Object>()) {
-    accumulator_samples = 0;
-    total_epochs = 0;
-    completed_epochs = 0;
+    total_tiles = 0;
+    completed_tiles = 0;
+    sample_budget = 0;
+    traced_rays = visited_nodes = tested_prims = 0;
+    secondary_rays = secondary_hits = secondary_ns = 0;
     out_w = out_h = 0;
     n_samples = 0;
 }
@@ -41,7 +71,13 @@ void Pathtracer::build_lights(Scene& layout_scene) {
             } break;
             case Light_Type::sphere: {
                 if(light.opt.has_emissive_map) {
-                    env_light = Env_Light(Env_Map(light.emissive_copy()));
+                    uint64_t start = SDL_GetPerformanceCounter();
+                    Env_Map map(light.emissive_copy());
+                    double ms = 1000.0 * (SDL_GetPerformanceCounter() - start) /
+                                SDL_GetPerformanceFrequency();
+                    info("Environment map %zux%zu: precomputed in %.1fms, %.1fMB",
+                         map.radiance.w, map.radiance.h, ms, map.bytes() / (1024.0 * 1024.0));
+                    env_light = Env_Light(std::move(map));
                 } else {
                     env_light = Env_Light(Env_Sphere(r));
                 }
@@ -63,7 +99,7 @@ void Pathtracer::build_lights(Scene& layout_scene) {
     });
 }
 
-void Pathtracer::build_scene(Scene& layout_scene) {
+void Pathtracer::build_scene(Scene& layout_scene, bool refit) {
 
     // It would be nice to let the interface be usable here (as with
     // the path-tracing part), but this would cause too much hassle with
@@ -73,13 +109,62 @@ void Pathtracer::build_scene(Scene& layout_scene) {
     // of a deal, as BVH building should take at most a few seconds
     // even with many big meshes.
 
-    // We could also do instancing instead of duplicating the bvh
-    // for big meshes, but that's something to add in the future
+    // Identical meshes (particles, or objects duplicated in the layout) are built
+    // into a single Tri_Mesh, which every object using it instances with its own pose.
+    struct Shared_Mesh {
+        const GL::Mesh* source;
+        std::future<std::shared_ptr<Tri_Mesh>> mesh;
+    };
+    struct Mesh_Object {
+        size_t mesh;
+        Scene_ID id;
+        unsigned int material;
+        Mat4 T;
+    };
+    std::vector<Shared_Mesh> shared_meshes;
+    std::unordered_multimap<size_t, size_t> shared_lookup;
+    std::vector<Mesh_Object> mesh_objects;
+
+    // When refitting, the mesh an object used in the previous render is moved to its new
+    // pose instead of being rebuilt, as long as its topology is unchanged. A mesh that
+    // was shared by several objects can only be reused by one of them.
+    std::unordered_map<Scene_ID, std::shared_ptr<Tri_Mesh>> previous;
+    std::unordered_set<const Tri_Mesh*> reused;
+    if(refit) previous = std::move(mesh_cache);
+    mesh_cache.clear();
+
+    bool use_bvh = scene_use_bvh, wide_bvh = scene_wide_bvh;
+    Thread_Pool* pool = &thread_pool;
+    BVH_Cache* cache = use_bvh && bvh_cache.enabled() ? &bvh_cache : nullptr;
+
+    auto share_mesh = [&](const GL::Mesh& mesh, Scene_ID id) {
+        size_t hash = mesh_hash(mesh);
+        auto [begin, end] = shared_lookup.equal_range(hash);
+        for(auto it = begin; it != end; it++) {
+            if(same_mesh(*shared_meshes[it->second].source, mesh)) return it->second;
+        }
+
+        std::shared_ptr<Tri_Mesh> prev;
+        auto cached = previous.find(id);
+        if(cached != previous.end() && reused.insert(cached->second.get()).second) {
+            prev = cached->second;
+        }
+
+        size_t idx = shared_meshes.size();
+        shared_meshes.push_back(
+            {&mesh, thread_pool.enqueue([&mesh, prev, use_bvh, wide_bvh, pool, cache]() {
+                 if(prev && prev->refit(mesh, pool)) return prev;
+                 if(cache) return cache->build(mesh, wide_bvh, pool);
+                 return std::make_shared<Tri_Mesh>(mesh, use_bvh, wide_bvh, pool);
+             })});
+        shared_lookup.insert({hash, idx});
+        return idx;
+    };
 
     materials.clear();
 
     std::vector<std::future<std::vector<Object>>> futures;
-    std::vector<Object> area_light_list;
+    area_lights.clear();
 
     layout_scene.for_items([&, this](Scene_Item& item) {
         if(item.is<Scene_Object>()) {
@@ -106,30 +191,29 @@ void Pathtracer::build_scene(Scene& layout_scene) {
             case Material_Type::diffuse_light: {
                 materials.push_back(BSDF(BSDF_Diffuse(obj.material.emissive())));
                 // NOTE(max): we use an approximate triangle mesh for shape objects
-                // because PT::Object only supports sampling triangles
+                // because the light tree only supports sampling triangles
                 if(obj.is_shape()) {
-                    area_light_list.push_back(Object(Tri_Mesh(obj.opt.shape.mesh(), false),
-                                                     obj.id(), idx, obj.pose.transform()));
+                    area_lights.add(obj.opt.shape.mesh(), obj.pose.transform(),
+                                    obj.material.emissive());
                 } else {
-                    area_light_list.push_back(Object(Tri_Mesh(obj.posed_mesh(), false), obj.id(),
-                                                     idx, obj.pose.transform()));
+                    area_lights.add(obj.posed_mesh(), obj.pose.transform(),
+                                    obj.material.emissive());
                 }
             } break;
             default: return;
             }
 
-            bool use_bvh = scene_use_bvh;
-            futures.push_back(thread_pool.enqueue([&obj, use_bvh, idx]() {
-                std::vector<Object> objs;
-                if(obj.is_shape()) {
+            if(obj.is_shape()) {
+                futures.push_back(thread_pool.enqueue([&obj, idx]() {
+                    std::vector<Object> objs;
                     Shape shape(obj.opt.shape);
                     objs.emplace_back(std::move(shape), obj.id(), idx, obj.pose.transform());
-                } else {
-                    Tri_Mesh mesh(obj.posed_mesh(), use_bvh);
-                    objs.emplace_back(std::move(mesh), obj.id(), idx, obj.pose.transform());
-                }
-                return objs;
-            }));
+                    return objs;
+                }));
+            } else {
+                size_t mesh = share_mesh(obj.posed_mesh(), obj.id());
+                mesh_objects.push_back({mesh, obj.id(), idx, obj.pose.transform()});
+            }
 
         } else if(item.is<Scene_Particles>()) {
 
@@ -137,21 +221,14 @@ void Pathtracer::build_scene(Scene& layout_scene) {
             unsigned int idx = (unsigned int)materials.size();
             materials.push_back(BSDF(BSDF_Lambertian(particles.opt.color.to_linear())));
 
-            bool use_bvh = scene_use_bvh;
-            futures.push_back(thread_pool.enqueue([&particles, use_bvh, idx]() {
-                Tri_Mesh mesh(particles.mesh(), use_bvh);
-
-                const auto& parts = particles.get_particles();
-                std::vector<Object> particle_objs;
+            const auto& parts = particles.get_particles();
+            if(parts.empty()) return;
 
-                for(const Scene_Particles::Particle& p : parts) {
-                    Tri_Mesh copy = mesh.copy();
-                    Mat4 T = Mat4::translate(p.pos) * Mat4::scale(Vec3{particles.opt.scale});
-                    particle_objs.emplace_back(std::move(copy), particles.id(), idx, T);
-                }
-
-                return particle_objs;
-            }));
+            size_t mesh = share_mesh(particles.mesh(), particles.id());
+            for(const Scene_Particles::Particle& p : parts) {
+                Mat4 T = Mat4::translate(p.pos) * Mat4::scale(Vec3{particles.opt.scale});
+                mesh_objects.push_back({mesh, particles.id(), idx, T});
+            }
         }
     });
 
@@ -163,11 +240,24 @@ void Pathtracer::build_scene(Scene& layout_scene) {
         std::move(std::begin(result), std::end(result), std::back_inserter(obj_list));
     }
 
-    area_lights = List(std::move(area_light_list));
+    std::vector<std::shared_ptr<Tri_Mesh>> meshes;
+    for(auto& shared : shared_meshes) {
+        meshes.push_back(shared.mesh.get());
+    }
+    obj_list.reserve(obj_list.size() + mesh_objects.size());
+    for(const Mesh_Object& obj : mesh_objects) {
+        obj_list.emplace_back(Tri_Mesh_Instance(meshes[obj.mesh]), obj.id, obj.material, obj.T);
+        mesh_cache[obj.id] = meshes[obj.mesh];
+    }
+
+    area_lights.build();
     build_lights(layout_scene);
 
-    if(scene_use_bvh) {
-        BVH<Object> scene_bvh(std::move(obj_list));
+    if(scene_use_bvh && scene_wide_bvh) {
+        MBVH<Object> scene_mbvh(std::move(obj_list), 1, &thread_pool);
+        scene = Object(std::move(scene_mbvh));
+    } else if(scene_use_bvh) {
+        BVH<Object> scene_bvh(std::move(obj_list), 1, &thread_pool);
         scene = Object(std::move(scene_bvh));
     } else {
         List<Object> scene_list(std::move(obj_list));
@@ -179,59 +269,280 @@ void Pathtracer::set_samples(size_t samples) {
     n_samples = samples;
 }
 
-void Pathtracer::set_params(size_t w, size_t h, size_t samples, size_t depth, bool use_bvh) {
+void Pathtracer::set_sequence(RNG::Sequence seq) {
+    sequence = seq;
+}
+
+void Pathtracer::set_seed(uint32_t s) {
+    seed = s;
+}
+
+void Pathtracer::set_wavefront(bool w) {
+    wavefront = w;
+}
+
+void Pathtracer::set_ray_sorting(bool sort) {
+    ray_sorting = sort;
+}
+
+void Pathtracer::set_rr_depth(size_t depth) {
+    rr_depth = depth;
+}
+
+void Pathtracer::set_bvh_cache(std::string dir) {
+    bvh_cache.set_directory(std::move(dir));
+}
+
+BVH_Cache::Stats Pathtracer::bvh_cache_stats() const {
+    return bvh_cache.stats();
+}
+
+void Pathtracer::set_params(size_t w, size_t h, size_t samples, size_t depth, bool use_bvh,
+                            bool wide_bvh, float threshold) {
     out_w = w;
     out_h = h;
     n_samples = samples;
     max_depth = depth;
+    adaptive_threshold = threshold;
+    if(use_bvh != scene_use_bvh || wide_bvh != scene_wide_bvh) mesh_cache.clear();
     scene_use_bvh = use_bvh;
+    scene_wide_bvh = wide_bvh;
     accumulator.resize(out_w, out_h);
+    heatmap.resize(out_w, out_h);
+    build_tiles();
+}
+
+void Pathtracer::build_tiles() {
+    size_t nx = (out_w + tile_dim - 1) / tile_dim;
+    size_t ny = (out_h + tile_dim - 1) / tile_dim;
+    tiles = std::vector<Tile>(nx * ny);
+    for(size_t ty = 0; ty < ny; ty++) {
+        for(size_t tx = 0; tx < nx; tx++) {
+            Tile& tile = tiles[ty * nx + tx];
+            tile.x = tx * tile_dim;
+            tile.y = ty * tile_dim;
+            tile.w = std::min(tile_dim, out_w - tile.x);
+            tile.h = std::min(tile_dim, out_h - tile.y);
+            tile.pixels.resize(tile.w * tile.h);
+            tile.counts.resize(tile.w * tile.h);
+            tile.moments.resize(tile.w * tile.h);
+        }
+    }
 }
 
 void Pathtracer::log_ray(const Ray& ray, float t, Spectrum color) {
     gui.log_ray(ray, t, color);
 }
 
-void Pathtracer::accumulate(const HDR_Image& sample) {
+void Pathtracer::accumulate(Tile& tile, const std::vector<Pixel_Samples>& sample) {
+
+    uint32_t version = tile.version.load(std::memory_order_relaxed);
+    tile.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    // Merge each pixel's new samples into its running mean and variance (Chan et al.)
+    for(size_t i = 0; i < tile.pixels.size(); i++) {
+
+        const Pixel_Samples& s = sample[i];
+        if(s.count == 0) continue;
+
+        uint32_t prev = tile.counts[i], n = prev + s.count;
+        Spectrum4 mean = s.sum * (1.0f / s.count);
+        float luma = mean.luma();
+        float delta = luma - tile.pixels[i].luma();
+
+        tile.moments[i] += std::max(s.luma_sq - s.count * luma * luma, 0.0f) +
+                           delta * delta * ((float)prev * s.count / n);
+        tile.pixels[i] += (mean - tile.pixels[i]) * ((float)s.count / n);
+        tile.counts[i] = n;
+    }
+
+    tile.version.store(version + 2, std::memory_order_release);
+}
+
+bool Pathtracer::needs_samples(const Tile& tile, size_t i) const {
 
-    std::lock_guard<std::mutex> lock(accumulator_mut);
+    if(adaptive_threshold <= 0.0f) return true;
 
-    accumulator_samples++;
-    for(size_t j = 0; j < out_h; j++) {
-        for(size_t i = 0; i < out_w; i++) {
-            Spectrum& s = accumulator.at(i, j);
-            const Spectrum& n = sample.at(i, j);
-            s += (n - s) * (1.0f / accumulator_samples);
+    size_t n = tile.counts[i];
+    if(n < std::min(n_samples, adaptive_batch)) return true;
+    if(n >= max_adaptive_scale * target_samples) return false;
+
+    // Compare the standard error of the mean luma to the threshold relative to the mean
+    float variance = tile.moments[i] / (n - 1);
+    float error = adaptive_threshold * std::max(tile.pixels[i].luma(), min_luma);
+    return variance > error * error * n;
+}
+
+void Pathtracer::update_output() {
+
+    // Copy tiles that changed since they were last shown. A tile that is being written, or
+    // that changed during the copy, keeps its old version and is copied again next time.
+    float scale = target_samples ? 1.0f / target_samples : 0.0f;
+    for(Tile& tile : tiles) {
+
+        uint32_t version = tile.version.load(std::memory_order_acquire);
+        if(version == tile.shown || (version & 1)) continue;
+
+        for(size_t j = 0; j < tile.h; j++) {
+            for(size_t i = 0; i < tile.w; i++) {
+                accumulator.at(tile.x + i, tile.y + j) = tile.pixels[j * tile.w + i].spectrum();
+                heatmap.at(tile.x + i, tile.y + j) = Spectrum{tile.counts[j * tile.w + i] * scale};
+            }
         }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(tile.version.load(std::memory_order_relaxed) == version) tile.shown = version;
     }
 }
 
-void Pathtracer::do_trace(size_t samples) {
+void Pathtracer::render_tiles(size_t worker) {
+
+    size_t samples = n_samples;
+    if(adaptive_threshold > 0.0f) samples = std::min(n_samples, adaptive_batch);
+
+    size_t idx;
+    while(next_tile(worker, idx)) {
 
-    HDR_Image sample(out_w, out_h);
-    for(size_t j = 0; j < out_h; j++) {
-        for(size_t i = 0; i < out_w; i++) {
+        bool more = trace_tile(tiles[idx], samples);
+        if(cancel_flag) return;
+
+        // A tile that needs another pass goes to the back of the queue, so the other tiles
+        // get their next pass first.
+        if(more) {
+            Tile_Queue& own = tile_queues[worker];
+            std::lock_guard<std::mutex> lock(own.mut);
+            own.tiles.push_back(idx);
+            continue;
+        }
+
+        size_t completed = completed_tiles++;
+        if(completed + 1 == total_tiles) {
+            Uint64 done = SDL_GetPerformanceCounter();
+            render_time = done - render_time;
+        }
+    }
+}
+
+bool Pathtracer::next_tile(size_t worker, size_t& tile) {
+
+    {
+        Tile_Queue& own = tile_queues[worker];
+        std::lock_guard<std::mutex> lock(own.mut);
+        if(!own.tiles.empty()) {
+            tile = own.tiles.front();
+            own.tiles.pop_front();
+            return true;
+        }
+    }
+
+    for(size_t i = 1; i < tile_queues.size(); i++) {
+        Tile_Queue& victim = tile_queues[(worker + i) % tile_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mut);
+        if(!victim.tiles.empty()) {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Pathtracer::trace_tile(Tile& tile, size_t samples) {
+
+    // With adaptive sampling, a pass only samples the pixels that have not converged, and
+    // draws them from the render's sample budget. The first pass over a tile always runs,
+    // so that every pixel has enough samples to estimate its variance.
+    bool adaptive = adaptive_threshold > 0.0f;
+    std::vector<bool> active(tile.pixels.size(), true);
+    if(adaptive) {
+        int64_t n_active = 0;
+        for(size_t i = 0; i < active.size(); i++) {
+            active[i] = needs_samples(tile, i);
+            n_active += active[i];
+        }
+        if(n_active == 0) return false;
+        int64_t budget = sample_budget.fetch_sub(n_active * (int64_t)samples);
+        if(budget <= 0 && tile.passes > 0) return false;
+    }
+    tile.passes++;
+
+    trace_stats = {};
+
+    std::vector<Pixel_Samples> sample(tile.w * tile.h);
+    bool traced = wavefront ? trace_wavefront(tile, active, samples, sample)
+                            : trace_packets(tile, active, samples, sample);
+    if(!traced) return false;
+
+    traced_rays += trace_stats.rays;
+    visited_nodes += trace_stats.nodes;
+    tested_prims += trace_stats.primitives;
+    secondary_rays += trace_stats.secondary;
+    secondary_hits += trace_stats.secondary_hits;
+    secondary_ns += trace_stats.secondary_ns;
+    accumulate(tile, sample);
+
+    if(!adaptive) return false;
+    for(size_t i = 0; i < tile.pixels.size(); i++) {
+        if(needs_samples(tile, i)) return true;
+    }
+    return false;
+}
+
+bool Pathtracer::trace_packets(const Tile& tile, const std::vector<bool>& active,
+                               size_t samples, std::vector<Pixel_Samples>& sample) {
+
+    // Camera rays through neighbouring pixels are coherent, so the first bounce of each
+    // sample is traced as one packet per block of pixels. Shading and every later bounce
+    // proceed one ray at a time. Each pixel sample is a point in the chosen sequence:
+    // shading resumes drawing from the dimension after those the camera ray used.
+    static_assert(packet_dim * packet_dim <= max_packet_size);
+
+    for(size_t by = 0; by < tile.h; by += packet_dim) {
+        for(size_t bx = 0; bx < tile.w; bx += packet_dim) {
+
+            size_t pixels[max_packet_size];
+            size_t n = 0;
+            for(size_t y = by; y < std::min(by + packet_dim, tile.h); y++) {
+                for(size_t x = bx; x < std::min(bx + packet_dim, tile.w); x++) {
+                    if(active[y * tile.w + x]) pixels[n++] = y * tile.w + x;
+                }
+            }
+            if(n == 0) continue;
 
-            size_t sampled = 0;
             for(size_t s = 0; s < samples; s++) {
 
-                Spectrum p = trace_pixel(i, j);
-                if(p.valid()) {
-                    sample.at(i, j) += p;
-                    sampled++;
+                Ray rays[max_packet_size];
+                Trace hits[max_packet_size];
+                uint32_t ids[max_packet_size], index[max_packet_size], dims[max_packet_size];
+                for(size_t k = 0; k < n; k++) {
+                    size_t x = tile.x + pixels[k] % tile.w, y = tile.y + pixels[k] / tile.w;
+                    ids[k] = (uint32_t)(y * out_w + x);
+                    index[k] = (uint32_t)(tile.counts[pixels[k]] + s);
+                    RNG::begin_sample(sequence, seed, ids[k], index[k]);
+                    rays[k] = camera_ray(x, y);
+                    dims[k] = RNG::end_sample();
                 }
 
-                if(cancel_flag) return;
-            }
+                trace_stats.rays += n;
+                scene.hit_packet(rays, hits, n);
+
+                for(size_t k = 0; k < n; k++) {
+                    RNG::begin_sample(sequence, seed, ids[k], index[k], dims[k]);
+                    auto [emissive, reflected] = trace(rays[k], hits[k]);
+                    RNG::end_sample();
+                    sample[pixels[k]].add(Spectrum4(emissive + reflected));
+                }
 
-            if(sampled > 0) sample.at(i, j) *= (1.0f / sampled);
+                if(cancel_flag) return false;
+            }
         }
     }
-    accumulate(sample);
+    return true;
 }
 
 bool Pathtracer::in_progress() const {
-    return completed_epochs.load() < total_epochs;
+    return completed_tiles.load() < total_tiles;
 }
 
 std::pair<float, float> Pathtracer::completion_time() const {
@@ -239,68 +550,108 @@ std::pair<float, float> Pathtracer::completion_time() const {
     return {(float)(build_time / freq), (float)(render_time / freq)};
 }
 
+Trace_Stats Pathtracer::stats() const {
+    Trace_Stats ret;
+    ret.rays = traced_rays.load();
+    ret.nodes = visited_nodes.load();
+    ret.primitives = tested_prims.load();
+    ret.secondary = secondary_rays.load();
+    ret.secondary_hits = secondary_hits.load();
+    ret.secondary_ns = secondary_ns.load();
+    return ret;
+}
+
 float Pathtracer::progress() const {
-    return (float)completed_epochs.load() / (float)total_epochs;
+    if(total_tiles == 0) return 1.0f;
+    float done = (float)completed_tiles.load() / (float)total_tiles;
+    // Adaptive renders usually finish by spending their sample budget
+    if(adaptive_threshold > 0.0f && total_budget > 0) {
+        float spent = 1.0f - (float)sample_budget.load() / (float)total_budget;
+        done = std::max(done, std::min(spent, 1.0f));
+    }
+    return done;
 }
 
 size_t Pathtracer::visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t depth) {
     return scene.visualize(lines, active, depth, Mat4::I);
 }
 
-void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_samples) {
-
-    size_t n_threads = std::thread::hardware_concurrency();
-    size_t samples_per_epoch = std::max(size_t(1), n_samples / (n_threads * 10));
+void Pathtracer::begin_render(Scene& layout_scene, const Camera& cam, bool add_samples,
+                              bool refit) {
 
     cancel();
-    total_epochs = n_samples / samples_per_epoch + !!(n_samples % samples_per_epoch);
+    traced_rays = visited_nodes = tested_prims = 0;
+    secondary_rays = secondary_hits = secondary_ns = 0;
 
     if(!add_samples) {
         accumulator.clear({});
-        accumulator_samples = 0;
+        heatmap.clear({});
+        target_samples = 0;
+        for(Tile& tile : tiles) {
+            std::fill(tile.pixels.begin(), tile.pixels.end(), Spectrum4{});
+            std::fill(tile.counts.begin(), tile.counts.end(), 0);
+            std::fill(tile.moments.begin(), tile.moments.end(), 0.0f);
+            tile.shown = tile.version.load();
+        }
         build_time = SDL_GetPerformanceCounter();
-        build_scene(layout_scene);
+        build_scene(layout_scene, refit);
         build_time = SDL_GetPerformanceCounter() - build_time;
+    } else {
+        // The heatmap is relative to the samples requested so far, so every tile must be
+        // shown again. Shown versions are always even, so an odd one forces the copy.
+        for(Tile& tile : tiles) tile.shown = tile.version.load() + 1;
     }
     render_time = SDL_GetPerformanceCounter();
 
     camera = cam;
 
-    for(size_t s = 0; s < n_samples; s += samples_per_epoch) {
-        size_t samples = (s + samples_per_epoch) > n_samples ? n_samples - s : samples_per_epoch;
-        thread_pool.enqueue([samples, this]() {
-            do_trace(samples);
-            size_t completed = completed_epochs++;
-            if(completed + 1 == total_epochs) {
-                Uint64 done = SDL_GetPerformanceCounter();
-                render_time = done - render_time;
-            }
-        });
+    if(n_samples == 0) return;
+    total_tiles = tiles.size();
+    target_samples += n_samples;
+    total_budget = (int64_t)(n_samples * out_w * out_h);
+    sample_budget = total_budget;
+    for(Tile& tile : tiles) tile.passes = 0;
+
+    // Each thread starts on a contiguous run of tiles, so neighbouring tiles tend to be
+    // traced by the same thread; threads that finish early steal from the others.
+    size_t n_workers = tile_queues.size();
+    for(size_t t = 0; t < tiles.size(); t++) {
+        tile_queues[t * n_workers / tiles.size()].tiles.push_back(t);
+    }
+    for(size_t w = 0; w < n_workers; w++) {
+        thread_pool.enqueue([w, this]() { render_tiles(w); });
     }
 }
 
 void Pathtracer::cancel() {
     cancel_flag = true;
     thread_pool.clear();
-    completed_epochs = 0;
-    total_epochs = 0;
+    for(Tile_Queue& queue : tile_queues) queue.tiles.clear();
+    completed_tiles = 0;
+    total_tiles = 0;
     cancel_flag = false;
-    if(completed_epochs < total_epochs) 
+    if(completed_tiles < total_tiles) 
         render_time = SDL_GetPerformanceCounter() - render_time;
 }
 
 const HDR_Image& Pathtracer::get_output() {
+    update_output();
     return accumulator;
 }
 
 const GL::Tex2D& Pathtracer::get_output_texture(float exposure) {
-    std::lock_guard<std::mutex> lock(accumulator_mut);
+    update_output();
     return accumulator.get_texture(exposure);
 }
 
+const HDR_Image& Pathtracer::get_heatmap() {
+    update_output();
+    return heatmap;
+}
+
 Vec3 Pathtracer::sample_area_lights(Vec3 from) {
     if(!area_lights.empty() && env_light.has_value()) {
-        if(RNG::coin_flip(0.5f)) return env_light.value().sample();
+        if(RNG::sample_1D() < 0.5f) return env_light.value().sample();
         return area_lights.sample(from);
     }
     if(env_light.has_value()) {
@@ -328,23 +679,23 @@ Spectrum Pathtracer::point_lighting(const Shading_Info& hit) {
 
     if(hit.bsdf.is_discrete()) return {};
 
-    Spectrum radiance;
+    Spectrum4 radiance;
     for(auto& light : point_lights) {
         Light_Sample sample = light.sample(hit.pos);
         Vec3 in_dir = hit.world_to_object.rotate(sample.direction);
 
-        Spectrum attenuation = hit.bsdf.evaluate(hit.out_dir, in_dir);
+        Spectrum4 attenuation = hit.bsdf.evaluate(hit.out_dir, in_dir);
         if(attenuation.luma() == 0.0f) continue;
 
         Ray shadow_ray(hit.pos, sample.direction, Vec2{EPS_F, sample.distance - EPS_F});
 
-        Trace shadow = scene.hit(shadow_ray);
-        if(!shadow.hit) {
-            radiance += attenuation * sample.radiance;
+        trace_stats.rays++;
+        if(!scene.occluded(shadow_ray)) {
+            radiance += attenuation * Spectrum4(sample.radiance);
         }
     }
 
-    return radiance;
+    return radiance.spectrum();
 }
 
 } // namespace PT
@@ -2,17 +2,23 @@
 #pragma once
 
 #include <atomic>
+#include <deque>
 #include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "../lib/mathlib.h"
+#include "../lib/spectrum4.h"
 #include "../scene/scene.h"
 #include "../util/hdr_image.h"
+#include "../util/rand.h"
 #include "../util/thread_pool.h"
 
 #include "bsdf.h"
+#include "bvh_cache.h"
 #include "env_light.h"
 #include "light.h"
+#include "light_tree.h"
 #include "object.h"
 
 namespace Gui {
@@ -26,18 +32,47 @@ public:
     Pathtracer(Gui::Widget_Render& gui, Vec2 screen_dim);
     ~Pathtracer();
 
-    void set_params(size_t w, size_t h, size_t pixel_samples, size_t depth, bool use_bvh);
+    // A positive adaptive threshold enables adaptive sampling: pixels stop taking samples once
+    // the relative standard error of their luma falls below it, and the remaining budget of
+    // pixel_samples per pixel is spent on the pixels that are still noisy.
+    void set_params(size_t w, size_t h, size_t pixel_samples, size_t depth, bool use_bvh,
+                    bool wide_bvh = false, float adaptive_threshold = 0.0f);
     void set_samples(size_t samples);
+    // Sequence that the samples of each pixel draw their random dimensions from
+    void set_sequence(RNG::Sequence seq);
+    // Renders with the same seed and parameters are identical, whatever the number of
+    // threads. (Adaptive renders are too, unless they run out of sample budget.)
+    void set_seed(uint32_t seed);
+    // Selects the wavefront engine, which traces a tile's paths in large batches through
+    // separate generate, extend, shade and connect stages, instead of one path at a time.
+    void set_wavefront(bool wavefront);
+    // Makes the wavefront engine sort the rays of each bounce after the first so that rays
+    // that start close together and head the same way are traced one after another. Off by
+    // default: on the scenes it was measured on, the sort cost more than it saved.
+    void set_ray_sorting(bool sort);
+    // Paths that have bounced at least this many times continue with probability given by
+    // their throughput, and are reweighted to stay unbiased.
+    void set_rr_depth(size_t depth);
+    // Keeps the BVHs of meshes in this directory, to be loaded instead of rebuilt when the
+    // same meshes are rendered again, in this run or a later one. Off when empty (the default).
+    void set_bvh_cache(std::string dir);
+    BVH_Cache::Stats bvh_cache_stats() const;
 
     const HDR_Image& get_output();
     const GL::Tex2D& get_output_texture(float exposure);
+    // Samples taken by each pixel, relative to the requested samples per pixel
+    const HDR_Image& get_heatmap();
     size_t visualize_bvh(GL::Lines& lines, GL::Lines& active, size_t level);
 
-    void begin_render(Scene& scene, const Camera& camera, bool add_samples = false);
+    // With refit set, meshes whose topology is unchanged since the previous render (e.g. the
+    // next frame of an animation) are refit in place instead of being rebuilt.
+    void begin_render(Scene& scene, const Camera& camera, bool add_samples = false,
+                      bool refit = false);
     void cancel();
     bool in_progress() const;
     float progress() const;
     std::pair<float, float> completion_time() const;
+    Trace_Stats stats() const;
 
 private:
     struct Shading_Info {
@@ -47,27 +82,112 @@ private:
         size_t depth = 0;
     };
 
-    void build_scene(Scene& scene);
+    // The frame is split into tiles that are each traced with all of their samples at once.
+    // Tiles accumulate into their own pixels, which only the thread tracing the tile writes.
+    // The version is odd while a write is in progress, so the output image can take
+    // consistent snapshots of finished tiles without blocking the render threads.
+    struct Tile {
+        size_t x = 0, y = 0, w = 0, h = 0;
+        size_t passes = 0;
+        // Per pixel: the mean radiance, the number of samples, and the sum of squared
+        // deviations of the samples' luma from its mean (for the variance estimate).
+        std::vector<Spectrum4> pixels;
+        std::vector<uint32_t> counts;
+        std::vector<float> moments;
+        std::atomic<uint32_t> version = 0;
+        uint32_t shown = 0;
+    };
+    // The samples one pass over a tile traced for a pixel
+    struct Pixel_Samples {
+        Spectrum4 sum;
+        float luma_sq = 0.0f;
+        uint32_t count = 0;
+
+        // Skips samples that are NaN or infinite
+        void add(Spectrum4 p) {
+            if(!p.valid()) return;
+            float luma = p.luma();
+            sum += p;
+            luma_sq += luma * luma;
+            count++;
+        }
+    };
+    // Every render thread starts with its own queue of tiles. Once it runs dry, it steals
+    // from the back of the other threads' queues.
+    struct Tile_Queue {
+        std::mutex mut;
+        std::deque<size_t> tiles;
+    };
+
+    void build_scene(Scene& scene, bool refit);
     void build_lights(Scene& scene);
-    void do_trace(size_t samples);
-    void accumulate(const HDR_Image& sample);
+    void build_tiles();
+    void render_tiles(size_t worker);
+    bool next_tile(size_t worker, size_t& tile);
+    bool trace_tile(Tile& tile, size_t samples);
+    // Trace the samples of a tile's active pixels, returning false if the render was cancelled
+    bool trace_packets(const Tile& tile, const std::vector<bool>& active, size_t samples,
+                       std::vector<Pixel_Samples>& sample);
+    void accumulate(Tile& tile, const std::vector<Pixel_Samples>& sample);
+    bool needs_samples(const Tile& tile, size_t pixel) const;
+    void update_output();
     bool tonemap();
 
+    // Wavefront engine (rays/wavefront.cpp)
+    struct Paths;
+    bool trace_wavefront(const Tile& tile, const std::vector<bool>& active, size_t samples,
+                         std::vector<Pixel_Samples>& sample);
+    void generate(Paths& paths, const Tile& tile, const std::pair<uint32_t, uint32_t>* work,
+                  size_t n);
+    void extend(Paths& paths, bool camera);
+    void sort_rays(Paths& paths);
+    void sort_hits(Paths& paths, bool camera);
+    template<typename T> void shade(Paths& paths);
+    void connect(Paths& paths);
+
+    static constexpr size_t tile_dim = 16;
+    // Camera rays are traced in packets covering square blocks of this many pixels a side
+    static constexpr size_t packet_dim = 4;
+    // Adaptive sampling traces tiles in passes of this many samples per pixel, and a pixel
+    // may take up to max_adaptive_scale times the requested samples if it stays noisy.
+    static constexpr size_t adaptive_batch = 16;
+    static constexpr size_t max_adaptive_scale = 8;
+    // Error is measured relative to at least this luma, so that dark pixels can converge
+    static constexpr float min_luma = 0.01f;
+    // The wavefront engine keeps at most this many paths in flight per thread
+    static constexpr size_t wavefront_size = 4096;
+
     Gui::Widget_Render& gui;
     unsigned long long render_time, build_time;
     Thread_Pool thread_pool;
     bool cancel_flag = false;
 
-    HDR_Image accumulator;
-    std::mutex accumulator_mut;
-    size_t total_epochs, accumulator_samples;
-    std::atomic<size_t> completed_epochs;
+    HDR_Image accumulator, heatmap;
+    std::vector<Tile> tiles;
+    std::vector<Tile_Queue> tile_queues;
+    size_t total_tiles;
+    std::atomic<size_t> completed_tiles;
+    std::atomic<int64_t> sample_budget;
+    int64_t total_budget = 0;
+    std::atomic<size_t> traced_rays, visited_nodes, tested_prims;
+    std::atomic<size_t> secondary_rays, secondary_hits, secondary_ns;
 
     Spectrum trace_pixel(size_t x, size_t y);
+    Ray camera_ray(size_t x, size_t y);
     Spectrum sample_direct_lighting(const Shading_Info& hit);
-    Spectrum sample_indirect_lighting(const Shading_Info& hit);
+    Ray sample_indirect_lighting(const Shading_Info& hit);
+    // Russian roulette: may end a path after the given number of bounces, otherwise
+    // scales its throughput to compensate for the paths that were ended.
+    template<typename S> bool survives(S& throughput, size_t bounces) {
+        if(bounces < rr_depth) return true;
+        float survive = std::min(throughput.luma(), 1.0f);
+        if(!(survive > 0.0f) || RNG::sample_1D() >= survive) return false;
+        throughput *= 1.0f / survive;
+        return true;
+    }
 
     std::pair<Spectrum, Spectrum> trace(const Ray& ray);
+    std::pair<Spectrum, Spectrum> trace(const Ray& ray, Trace result);
     Spectrum point_lighting(const Shading_Info& hit);
     Vec3 sample_area_lights(Vec3 from);
     float area_lights_pdf(Vec3 from, Vec3 dir);
@@ -75,8 +195,10 @@ private:
     void log_ray(const Ray& ray, float t, Spectrum color = Spectrum{1.0f});
 
     Object scene;
-    List<Object> area_lights;
-    bool scene_use_bvh = true;
+    Light_Tree area_lights;
+    std::unordered_map<Scene_ID, std::shared_ptr<Tri_Mesh>> mesh_cache;
+    BVH_Cache bvh_cache;
+    bool scene_use_bvh = true, scene_wide_bvh = false;
 
     std::vector<BSDF> materials;
     std::vector<Delta_Light> point_lights;
@@ -84,6 +206,12 @@ private:
 
     Camera camera;
     size_t out_w, out_h, n_samples, max_depth;
+    size_t rr_depth = 3;
+    size_t target_samples = 0;
+    float adaptive_threshold = 0.0f;
+    RNG::Sequence sequence = RNG::Sequence::sobol;
+    uint32_t seed = 0;
+    bool wavefront = false, ray_sorting = false;
 };
 
 } // namespace PT
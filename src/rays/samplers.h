@@ -1,6 +1,9 @@
 
 #pragma once
 
+#include <cstdint>
+#include <vector>
+
 #include "../lib/mathlib.h"
 #include "../util/hdr_image.h"
 
@@ -30,6 +33,27 @@ struct Triangle {
     Vec3 v0, v1, v2;
 };
 
+// Chooses index i with probability proportional to weights[i] in constant time, using
+// Vose's alias method: each of n equally likely bins keeps its own index with probability
+// q and otherwise gives way to its alias. If no weight is positive, indices are uniform.
+struct Alias {
+    Alias() = default;
+    Alias(const std::vector<float>& weights);
+    // Consumes one dimension of the current sample
+    size_t sample() const;
+    size_t sample(float u) const;
+    float pmf(size_t i) const;
+    bool empty() const;
+
+    struct Bin {
+        float q = 1.0f;
+        uint32_t alias = 0;
+    };
+    std::vector<Bin> bins;
+    std::vector<float> _pmf;
+    float total = 0.0f;
+};
+
 namespace Hemisphere {
 
 struct Uniform {
@@ -51,14 +75,24 @@ struct Uniform {
     Hemisphere::Uniform hemi;
 };
 
+// Equirectangular image coordinates of a direction: u is phi / 2pi, measured around +y
+// from +x towards +z, and v is 1 - theta / pi, where theta is the angle from +y. Image rows
+// are stored bottom-up, so v = 0 is the first row.
+Vec2 to_uv(Vec3 dir);
+Vec3 from_uv(Vec2 uv);
+
+// Samples directions in proportion to the radiance of an environment map. Each pixel is
+// weighted by its luma and the solid angle it subtends, and is picked in constant time
+// through an alias table over the whole image. The direction is then uniform in
+// (phi, theta) within the pixel.
 struct Image {
     Image(const HDR_Image& image);
     Vec3 sample() const;
     float pdf(Vec3 dir) const;
+    size_t bytes() const;
 
     size_t w = 0, h = 0;
-    std::vector<float> _pdf, _cdf;
-    float total = 0.0f;
+    Alias pixels;
 };
 
 } // namespace Sphere
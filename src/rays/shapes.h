@@ -48,6 +48,31 @@ public:
         return std::visit(overloaded{[&ray](const auto& o) { return o.hit(ray); }}, underlying);
     }
 
+    // Shapes are intersected in a space where the ray direction is normalized; distances
+    // are converted back to the units of the ray's (possibly unnormalized) direction.
+    Hit intersect(Ray ray) const {
+        float scale = normalize(ray);
+        Trace trace = hit(ray);
+        Hit ret;
+        ret.hit = trace.hit;
+        ret.distance = trace.distance / scale;
+        return ret;
+    }
+    Trace finalize(const Hit&, Ray ray) const {
+        float scale = normalize(ray);
+        Trace ret = hit(ray);
+        ret.distance /= scale;
+        return ret;
+    }
+
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+        intersect_each(*this, rays, hits, n);
+    }
+
+    bool occluded(const Ray& ray) const {
+        return intersect(ray).hit;
+    }
+
     template<typename T> T& get() {
         return std::get<T>(underlying);
     }
@@ -67,6 +92,13 @@ public:
     }
 
 private:
+    static float normalize(Ray& ray) {
+        float scale = ray.dir.norm();
+        ray.dir /= scale;
+        ray.dist_bounds *= scale;
+        return scale;
+    }
+
     std::variant<Sphere> underlying;
 };
 
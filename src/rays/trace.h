@@ -5,6 +5,10 @@
 
 namespace PT {
 
+class Object;
+class Triangle;
+
+/// A full description of a ray's closest hit, as used for shading
 struct Trace {
 
     bool hit = false;
@@ -22,12 +26,77 @@ struct Trace {
         return {};
     }
 
-    void transform(const Mat4& transform, const Mat4& norm) {
-        position = transform * position;
-        origin = transform * origin;
-        normal = norm.rotate(normal).unit();
+    /// Move the hit out of the space of an object with transform T and inverse iT
+    void transform(const Affine& T, const Affine& iT) {
+        position = T * position;
+        origin = T * origin;
+        normal = iT.rotate_transposed(normal).unit();
         distance = (position - origin).norm();
     }
 };
 
+/// The record kept while traversing the scene: just enough to find the closest hit and to
+/// compute its Trace afterwards, which Object::finalize does once for the winning hit.
+/// Distances are measured along the ray passed to the top-level query.
+struct Hit {
+
+    bool hit = false;
+    float distance = 0.0f;
+    /// Barycentric coordinates of the hit point, weighting the triangle's second and
+    /// third vertices
+    Vec2 uv;
+    /// The triangle that was hit (null for shapes)
+    const Triangle* triangle = nullptr;
+    /// The innermost object that contains the hit geometry
+    const Object* instance = nullptr;
+
+    static Hit min(const Hit& l, const Hit& r) {
+        if(l.hit && (!r.hit || l.distance < r.distance)) return l;
+        return r;
+    }
+};
+
+/// Most rays traced together by one intersect_packet query
+static const size_t max_packet_size = 16;
+
+/// Packet query for primitives that have no shared traversal: intersects each ray in turn,
+/// keeping whichever of the new and previous hits is closer.
+template<typename Primitive>
+void intersect_each(const Primitive& prim, const Ray* rays, Hit* hits, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        hits[i] = Hit::min(hits[i], prim.intersect(rays[i]));
+    }
+}
+
+/// Leaf queries used by the BVHs, which test each of a leaf's n primitives in turn.
+/// Primitives that can test a whole leaf at once (see Triangle) overload these.
+template<typename Primitive>
+void intersect_leaf(const Primitive* prims, size_t n, const Ray& ray, Hit& hit) {
+    for(size_t i = 0; i < n; i++) {
+        hit = Hit::min(hit, prims[i].intersect(ray));
+    }
+}
+template<typename Primitive>
+void intersect_leaf_packet(const Primitive* prims, size_t n, const Ray* rays, Hit* hits,
+                           size_t count) {
+    for(size_t i = 0; i < n; i++) {
+        prims[i].intersect_packet(rays, hits, count);
+    }
+}
+template<typename Primitive> bool occluded_leaf(const Primitive* prims, size_t n, const Ray& ray) {
+    for(size_t i = 0; i < n; i++) {
+        if(prims[i].occluded(ray)) return true;
+    }
+    return false;
+}
+
+/// Ray queries performed by the current thread, summed into the pathtracer's render statistics
+struct Trace_Stats {
+    size_t rays = 0, nodes = 0, primitives = 0;
+    // Rays after the first bounce traced by the wavefront engine: how many, how many hit
+    // the scene, and the nanoseconds spent ordering and tracing them
+    size_t secondary = 0, secondary_hits = 0, secondary_ns = 0;
+};
+inline thread_local Trace_Stats trace_stats;
+
 } // namespace PT
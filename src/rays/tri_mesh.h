@@ -1,11 +1,16 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
+
 #include "../lib/mathlib.h"
 #include "../platform/gl.h"
 
 #include "bvh.h"
 #include "list.h"
+#include "mbvh.h"
+#include "samplers.h"
 #include "trace.h"
 
 namespace PT {
@@ -15,30 +20,74 @@ struct Tri_Mesh_Vert {
     Vec3 normal;
 };
 
+// Intersection data for up to width triangles of one BVH leaf, stored as structure-of-arrays
+// so the whole block is tested against a ray with one SIMD instruction per step. Normals
+// are only needed for shading and stay with the vertices. Unused lanes are degenerate.
+struct alignas(32) Tri_Block {
+#ifdef MBVH_AVX
+    static const int width = 8;
+#else
+    static const int width = 4;
+#endif
+
+    float v0[3][width], e1[3][width], e2[3][width];
+
+    // Returns a bitmask of the lanes hit within bounds, writing each lane's distance and
+    // barycentric coordinates to t, u and v.
+    int intersect(const Ray& ray, Vec2 bounds, float (&t)[width], float (&u)[width],
+                  float (&v)[width]) const;
+};
+
 class Triangle {
 public:
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    // Finds the distance and barycentric coordinates of a hit; finalize computes its
+    // position and normal.
+    Hit intersect(const Ray& ray) const;
+    Trace finalize(const Hit& hit, const Ray& ray) const;
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+        intersect_each(*this, rays, hits, n);
+    }
+    bool occluded(const Ray& ray) const {
+        return intersect(ray).hit;
+    }
 
     size_t visualize(GL::Lines&, GL::Lines&, size_t, const Mat4&) const {
         return size_t(0);
     }
 
     Vec3 sample(Vec3 from) const;
-    float pdf(Ray ray, const Mat4& T, const Mat4& iT) const;
+    float pdf(Ray ray, const Affine& T, const Affine& iT) const;
 
 private:
-    Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2);
+    Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2,
+             unsigned int index);
 
     unsigned int v0, v1, v2;
+    // Which triangle of the mesh this is, in the order of its index buffer
+    unsigned int index;
     Tri_Mesh_Vert* vertex_list;
+    // Set on the first triangle of each BVH leaf: the leaf's triangles, in order, fill
+    // the lanes of consecutive blocks starting here.
+    const Tri_Block* block = nullptr;
+
     friend class Tri_Mesh;
+    friend void intersect_leaf(const Triangle*, size_t, const Ray&, Hit&);
+    friend bool occluded_leaf(const Triangle*, size_t, const Ray&);
 };
 
+// BVH leaf queries that test a leaf's triangles a block at a time
+void intersect_leaf(const Triangle* tris, size_t n, const Ray& ray, Hit& hit);
+void intersect_leaf_packet(const Triangle* tris, size_t n, const Ray* rays, Hit* hits,
+                           size_t count);
+bool occluded_leaf(const Triangle* tris, size_t n, const Ray& ray);
+
 class Tri_Mesh {
 public:
     Tri_Mesh() = default;
-    Tri_Mesh(const GL::Mesh& mesh, bool use_bvh = true);
+    Tri_Mesh(const GL::Mesh& mesh, bool use_bvh = true, bool wide_bvh = false,
+             Thread_Pool* pool = nullptr);
 
     Tri_Mesh(Tri_Mesh&& src) = default;
     Tri_Mesh& operator=(Tri_Mesh&& src) = default;
@@ -49,19 +98,100 @@ public:
 
     BBox bbox() const;
     Trace hit(const Ray& ray) const;
+    Hit intersect(const Ray& ray) const;
+    Trace finalize(const Hit& hit, const Ray& ray) const;
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const;
+    bool occluded(const Ray& ray) const;
 
     size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const;
 
-    void build(const GL::Mesh& mesh, bool use_bvh = true);
-
+    void build(const GL::Mesh& mesh, bool use_bvh = true, bool wide_bvh = false,
+               Thread_Pool* pool = nullptr);
+    // Moves the vertices to match a mesh with the same triangles as the one this was built
+    // from, and refits the BVH instead of rebuilding it (unless refitting degraded it past
+    // max_refit_cost). Returns false and leaves the mesh untouched if the topology differs.
+    bool refit(const GL::Mesh& mesh, Thread_Pool* pool = nullptr);
+    static constexpr float max_refit_cost = 1.5f;
+    // Most triangles the builder puts in a BVH leaf
+    static constexpr size_t leaf_size = 4;
+
+    // The BVH of a mesh built with use_bvh is described by its nodes, as raw bytes, and by
+    // which of the mesh's triangles its leaves hold, in leaf order. restore() sets up a mesh
+    // from these instead of building its BVH (see BVH_Cache), and returns false if they do
+    // not fit it. Only the tree structure is kept: bounds are recomputed from the vertices.
+    const void* bvh_nodes(size_t& bytes) const;
+    std::vector<uint32_t> bvh_triangles() const;
+    bool restore(const GL::Mesh& mesh, bool wide_bvh, const void* nodes, size_t node_bytes,
+                 const uint32_t* order, size_t n_triangles);
+
+    // Samples a point uniformly over the surface: triangles are chosen in proportion to
+    // their area through an alias table, independently of the BVH. The table is built by
+    // the first call to either, so meshes that are never sampled do not pay for it.
     Vec3 sample(Vec3 from) const;
-    float pdf(Ray ray, const Mat4& T, const Mat4& iT) const;
+    float pdf(Ray ray, const Affine& T, const Affine& iT) const;
 
 private:
-    bool use_bvh = true;
+    // Clears the mesh and copies the vertices and indices of another
+    void copy_mesh(const GL::Mesh& mesh);
+    // Recomputes the leaf blocks from the current vertex positions and BVH layout
+    void build_blocks();
+    // The alias table over triangle areas, built on first use
+    const Samplers::Alias& area_sampler() const;
+
+    // Held by pointer so that the mesh stays movable. build(), refit() and restore() replace
+    // it, which is only done while nothing is sampling the mesh.
+    struct Area_Sampler {
+        std::once_flag built;
+        Samplers::Alias alias;
+    };
+
+    bool use_bvh = true, wide_bvh = false;
     std::vector<Tri_Mesh_Vert> verts;
+    std::vector<Tri_Block> blocks;
+    // Vertex indices in mesh order, which refit() compares against and the alias table uses
+    std::vector<GL::Mesh::Index> indices;
+    std::unique_ptr<Area_Sampler> area = std::make_unique<Area_Sampler>();
     BVH<Triangle> triangle_bvh;
+    MBVH<Triangle> triangle_mbvh;
     List<Triangle> triangle_list;
 };
 
+// A reference to a triangle mesh shared by several objects. Each object supplies its own
+// transform, so the vertices and BVH of a mesh used many times are only stored once.
+class Tri_Mesh_Instance {
+public:
+    Tri_Mesh_Instance(std::shared_ptr<const Tri_Mesh> mesh) : mesh(std::move(mesh)) {
+    }
+
+    BBox bbox() const {
+        return mesh->bbox();
+    }
+    Hit intersect(const Ray& ray) const {
+        return mesh->intersect(ray);
+    }
+    Trace finalize(const Hit& hit, const Ray& ray) const {
+        return mesh->finalize(hit, ray);
+    }
+    void intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+        mesh->intersect_packet(rays, hits, n);
+    }
+    bool occluded(const Ray& ray) const {
+        return mesh->occluded(ray);
+    }
+
+    size_t visualize(GL::Lines& lines, GL::Lines& active, size_t level, const Mat4& trans) const {
+        return mesh->visualize(lines, active, level, trans);
+    }
+
+    Vec3 sample(Vec3 from) const {
+        return mesh->sample(from);
+    }
+    float pdf(Ray ray, const Affine& T, const Affine& iT) const {
+        return mesh->pdf(ray, T, iT);
+    }
+
+private:
+    std::shared_ptr<const Tri_Mesh> mesh;
+};
+
 } // namespace PT
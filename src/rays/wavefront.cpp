@@ -0,0 +1,323 @@
+#include "pathtracer.h"
+#include "../util/rand.h"
+
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <type_traits>
+
+namespace PT {
+
+// The paths in flight in the wavefront engine, stored as structure-of-arrays. Stages refer
+// to paths by index and each loops over one queue of indices.
+struct Pathtracer::Paths {
+
+    // Per path: the tile pixel it samples, the sample it draws its dimensions from and the
+    // next dimension to draw, its current ray and hit, and its throughput and radiance.
+    // Hits are only finalized for the paths that get shaded.
+    std::vector<uint32_t> pixel, id, index, dim;
+    std::vector<Ray> rays;
+    std::vector<Hit> hits;
+    std::vector<Spectrum4> throughput, radiance;
+
+    // Paths whose ray is still to be traced, and the sort keys sort_rays() orders them by
+    std::vector<uint32_t> alive;
+    std::vector<uint64_t> keys;
+    // Paths to shade, by the BSDF::type() of the surface they hit
+    std::vector<uint32_t> queues[std::variant_size_v<BSDF::Variant>];
+
+    // A ray towards a light, adding weight times the light it finds to a path's radiance.
+    // Shadow rays only test visibility; light rays look up the emission they hit.
+    struct Connection {
+        uint32_t path;
+        Ray ray;
+        Spectrum4 weight;
+    };
+    std::vector<Connection> shadow, light;
+};
+
+namespace {
+
+// Position of T in BSDF::Variant, which is what BSDF::type() returns for it
+template<typename T, size_t I = 0> constexpr size_t type_index() {
+    if constexpr(std::is_same_v<T, std::variant_alternative_t<I, BSDF::Variant>>) return I;
+    else return type_index<T, I + 1>();
+}
+
+// Spreads the low 10 bits of v out to every third bit, for interleaving into a Morton code
+uint32_t spread_bits(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+} // namespace
+
+bool Pathtracer::trace_wavefront(const Tile& tile, const std::vector<bool>& active,
+                                 size_t samples, std::vector<Pixel_Samples>& sample) {
+
+    // Samples are generated in the order the packet engine traces them, a block of pixels
+    // at a time, so consecutive camera rays are coherent enough to trace as packets.
+    std::vector<std::pair<uint32_t, uint32_t>> work;
+    for(size_t by = 0; by < tile.h; by += packet_dim) {
+        for(size_t bx = 0; bx < tile.w; bx += packet_dim) {
+
+            uint32_t pixels[max_packet_size];
+            size_t n = 0;
+            for(size_t y = by; y < std::min(by + packet_dim, tile.h); y++) {
+                for(size_t x = bx; x < std::min(bx + packet_dim, tile.w); x++) {
+                    if(active[y * tile.w + x]) pixels[n++] = (uint32_t)(y * tile.w + x);
+                }
+            }
+            for(size_t s = 0; s < samples; s++) {
+                for(size_t k = 0; k < n; k++) work.push_back({pixels[k], (uint32_t)s});
+            }
+        }
+    }
+
+    // Each bounce traces every live path, sorts the hits by BSDF type, shades each type in
+    // its own loop, and then traces all the rays towards lights that shading produced.
+    Paths paths;
+    for(size_t begin = 0; begin < work.size(); begin += wavefront_size) {
+
+        size_t n = std::min(wavefront_size, work.size() - begin);
+        generate(paths, tile, &work[begin], n);
+
+        for(bool camera = true; !paths.alive.empty(); camera = false) {
+            extend(paths, camera);
+            sort_hits(paths, camera);
+            paths.alive.clear();
+            shade<BSDF_Lambertian>(paths);
+            shade<BSDF_Mirror>(paths);
+            shade<BSDF_Glass>(paths);
+            shade<BSDF_Refract>(paths);
+            connect(paths);
+        }
+
+        for(size_t k = 0; k < n; k++) sample[paths.pixel[k]].add(paths.radiance[k]);
+        if(cancel_flag) return false;
+    }
+    return true;
+}
+
+void Pathtracer::generate(Paths& paths, const Tile& tile,
+                          const std::pair<uint32_t, uint32_t>* work, size_t n) {
+
+    paths.pixel.resize(n);
+    paths.id.resize(n);
+    paths.index.resize(n);
+    paths.dim.resize(n);
+    paths.rays.resize(n);
+    paths.hits.assign(n, Hit{});
+    paths.throughput.assign(n, Spectrum4{1.0f});
+    paths.radiance.assign(n, Spectrum4{});
+    paths.alive.resize(n);
+
+    for(size_t k = 0; k < n; k++) {
+        auto [pixel, s] = work[k];
+        size_t x = tile.x + pixel % tile.w, y = tile.y + pixel / tile.w;
+        paths.pixel[k] = pixel;
+        paths.id[k] = (uint32_t)(y * out_w + x);
+        paths.index[k] = (uint32_t)(tile.counts[pixel] + s);
+        RNG::begin_sample(sequence, seed, paths.id[k], paths.index[k]);
+        paths.rays[k] = camera_ray(x, y);
+        paths.dim[k] = RNG::end_sample();
+        paths.alive[k] = (uint32_t)k;
+    }
+}
+
+void Pathtracer::extend(Paths& paths, bool camera) {
+
+    size_t n = paths.alive.size();
+    trace_stats.rays += n;
+
+    // Every camera ray is alive, in the order generate() made them, and starts out as a miss
+    if(camera) {
+        for(size_t i = 0; i < n; i += max_packet_size) {
+            size_t m = std::min(max_packet_size, n - i);
+            scene.intersect_packet(&paths.rays[i], &paths.hits[i], m);
+        }
+        return;
+    }
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    if(ray_sorting) sort_rays(paths);
+    size_t hits = 0;
+    for(uint32_t k : paths.alive) {
+        paths.hits[k] = scene.intersect(paths.rays[k]);
+        hits += paths.hits[k].hit;
+    }
+    Uint64 ticks = SDL_GetPerformanceCounter() - start;
+
+    trace_stats.secondary += n;
+    trace_stats.secondary_hits += hits;
+    trace_stats.secondary_ns += (size_t)(ticks * 1e9 / SDL_GetPerformanceFrequency());
+}
+
+void Pathtracer::sort_rays(Paths& paths) {
+
+    // The key is the ray's direction octant (bits 61-63) followed by the Morton code of its
+    // origin on a 1024^3 grid over the scene bounds (bits 31-60), with the path index in the
+    // low 31 bits (batches hold wavefront_size paths). Rays leaving the same region in similar
+    // directions then visit the same BVH nodes in succession.
+    // Which paths are shaded, and each path's result, are independent of the order.
+    BBox box = scene.bbox();
+    Vec3 extent = box.max - box.min;
+    Vec3 scale;
+    for(int i = 0; i < 3; i++) scale[i] = extent[i] > 0.0f ? 1024.0f / extent[i] : 0.0f;
+
+    paths.keys.clear();
+    for(uint32_t k : paths.alive) {
+        const Ray& ray = paths.rays[k];
+        uint32_t code = 0;
+        for(int i = 0; i < 3; i++) {
+            float cell = clamp((ray.point[i] - box.min[i]) * scale[i], 0.0f, 1023.0f);
+            code |= spread_bits((uint32_t)cell) << (2 - i);
+        }
+        uint32_t octant = (ray.dir.x < 0.0f) | (ray.dir.y < 0.0f) << 1 | (ray.dir.z < 0.0f) << 2;
+        paths.keys.push_back((uint64_t)octant << 61 | (uint64_t)code << 31 | k);
+    }
+
+    std::sort(paths.keys.begin(), paths.keys.end());
+    for(size_t i = 0; i < paths.keys.size(); i++) {
+        paths.alive[i] = (uint32_t)(paths.keys[i] & 0x7fffffff);
+    }
+}
+
+void Pathtracer::sort_hits(Paths& paths, bool camera) {
+
+    for(auto& queue : paths.queues) queue.clear();
+
+    // As in trace(), only camera rays take the emission of what they hit. Later bounces
+    // reach lights through the light rays that connect() traces.
+    for(uint32_t k : paths.alive) {
+
+        const Hit& hit = paths.hits[k];
+        const Ray& ray = paths.rays[k];
+        if(!hit.hit) {
+            if(camera && env_light.has_value()) {
+                paths.radiance[k] +=
+                    paths.throughput[k] * Spectrum4(env_light.value().evaluate(ray.dir));
+            }
+            continue;
+        }
+
+        const BSDF& bsdf = materials[scene.material_of(hit)];
+        Spectrum4 emissive = bsdf.emissive();
+        if(emissive.luma() > 0.0f) {
+            if(camera) paths.radiance[k] += paths.throughput[k] * emissive;
+            continue;
+        }
+        if(ray.depth == 0) continue;
+
+        paths.queues[bsdf.type()].push_back(k);
+    }
+}
+
+template<typename T> void Pathtracer::shade(Paths& paths) {
+
+    const std::vector<uint32_t>& queue = paths.queues[type_index<T>()];
+    if(queue.empty()) return;
+
+    // Only Lambertian surfaces can be evaluated; the others scatter in discrete directions,
+    // so their attenuation already accounts for the probability of the direction.
+    constexpr bool continuous = std::is_same_v<T, BSDF_Lambertian>;
+    bool sided = materials[scene.material_of(paths.hits[queue[0]])].is_sided();
+    bool sample_lights = !area_lights.empty() || env_light.has_value();
+
+    for(uint32_t k : queue) {
+
+        RNG::begin_sample(sequence, seed, paths.id[k], paths.index[k], paths.dim[k]);
+
+        Ray& ray = paths.rays[k];
+        Trace hit = scene.finalize(paths.hits[k], ray);
+        const T& bsdf = materials[hit.material].get<T>();
+
+        Vec3 normal = hit.normal;
+        if(!sided && dot(normal, ray.dir) > 0.0f) normal = -normal;
+        Mat4 object_to_world = Mat4::rotate_to(normal);
+        Mat4 world_to_object = object_to_world.T();
+        Vec3 pos = hit.position;
+        Vec3 out_dir = world_to_object.rotate(ray.point - pos).unit();
+        Spectrum4 beta = paths.throughput[k];
+
+        Scatter scatter;
+        if constexpr(continuous) {
+
+            for(const Delta_Light& light : point_lights) {
+                Light_Sample sample = light.sample(pos);
+                Vec3 in_dir = world_to_object.rotate(sample.direction);
+                Spectrum4 attenuation = bsdf.evaluate(out_dir, in_dir);
+                if(attenuation.luma() == 0.0f) continue;
+                Ray shadow_ray(pos, sample.direction, Vec2{EPS_F, sample.distance - EPS_F});
+                paths.shadow.push_back(
+                    {k, shadow_ray, beta * (attenuation * Spectrum4(sample.radiance))});
+            }
+
+            // Direct lighting takes one sample from an even mixture of the BSDF and the lights
+            Vec3 in_dir;
+            if(sample_lights && RNG::sample_1D() < 0.5f) {
+                in_dir = world_to_object.rotate(sample_area_lights(pos));
+            } else {
+                in_dir = bsdf.scatter(out_dir).direction;
+            }
+            Vec3 light_dir = object_to_world.rotate(in_dir);
+            float pdf = bsdf.pdf(out_dir, in_dir);
+            if(sample_lights) pdf = 0.5f * (pdf + area_lights_pdf(pos, light_dir));
+            if(pdf > 0.0f) {
+                Spectrum4 weight = beta * bsdf.evaluate(out_dir, in_dir) * (1.0f / pdf);
+                Ray light_ray(pos, light_dir, Vec2{EPS_F, FLT_MAX});
+                if(weight.luma() > 0.0f) paths.light.push_back({k, light_ray, weight});
+            }
+
+            scatter = bsdf.scatter(out_dir);
+            float scatter_pdf = bsdf.pdf(out_dir, scatter.direction);
+            beta = scatter_pdf > 0.0f
+                       ? beta * scatter.attenuation * (1.0f / scatter_pdf)
+                       : Spectrum4{};
+        } else {
+
+            Scatter direct = bsdf.scatter(out_dir);
+            Spectrum4 weight = beta * direct.attenuation;
+            Ray light_ray(pos, object_to_world.rotate(direct.direction), Vec2{EPS_F, FLT_MAX});
+            if(weight.luma() > 0.0f) paths.light.push_back({k, light_ray, weight});
+
+            scatter = bsdf.scatter(out_dir);
+            beta = beta * scatter.attenuation;
+        }
+
+        // Camera rays start at max_depth, and each bounce takes one off
+        bool alive = beta.luma() > 0.0f && survives(beta, max_depth - ray.depth + 1);
+        paths.dim[k] = RNG::end_sample();
+        paths.throughput[k] = beta;
+        if(alive) {
+            ray = Ray(pos, object_to_world.rotate(scatter.direction), Vec2{EPS_F, FLT_MAX},
+                      ray.depth - 1);
+            paths.alive.push_back(k);
+        }
+    }
+}
+
+void Pathtracer::connect(Paths& paths) {
+
+    trace_stats.rays += paths.shadow.size() + paths.light.size();
+
+    for(const auto& c : paths.shadow) {
+        if(!scene.occluded(c.ray)) paths.radiance[c.path] += c.weight;
+    }
+
+    for(const auto& c : paths.light) {
+        Hit hit = scene.intersect(c.ray);
+        Spectrum4 emitted;
+        if(hit.hit) emitted = materials[scene.material_of(hit)].emissive();
+        else if(env_light.has_value()) emitted = Spectrum4(env_light.value().evaluate(c.ray.dir));
+        paths.radiance[c.path] += c.weight * emitted;
+    }
+
+    paths.shadow.clear();
+    paths.light.clear();
+}
+
+} // namespace PT
@@ -1,4 +1,3 @@
-
 #include "../lib/mathlib.h"
 #include "debug.h"
 
@@ -9,5 +8,54 @@ bool BBox::hit(const Ray& ray, Vec2& times) const {
     // If the ray intersected the bounding box within the range given by
     // [times.x,times.y], update times with the new intersection times.
 
-    return false;
+    return hit(Traversal_Ray(ray), times);
+}
+
+bool BBox::hit(const Traversal_Ray& ray, Vec2& times) const {
+
+    // Slab test on all three axes at once. The direction signs pick which side of each slab
+    // the ray enters through. Zero direction components give infinite reciprocals; max and
+    // min keep the running interval when the other operand is NaN, so the resulting NaNs
+    // (and those of the padding lane) leave the interval unchanged.
+    Vec3A lo(min), hi(max);
+    Vec3A t0 = (select(ray.inv_dir, hi, lo) - ray.point) * ray.inv_dir;
+    Vec3A t1 = (select(ray.inv_dir, lo, hi) - ray.point) * ray.inv_dir;
+    float tmin = SIMD::hmax(SIMD::max(t0.v, SIMD::splat(times.x)));
+    float tmax = SIMD::hmin(SIMD::min(t1.v, SIMD::splat(times.y)));
+    if(tmin > tmax) return false;
+
+    times = Vec2{tmin, tmax};
+    return true;
+}
+
+int BBox::hit(const BBox& a, const BBox& b, const Traversal_Ray& ray, Vec2& times_a,
+              Vec2& times_b) {
+
+    // The lanes hold the entry times of a and b followed by their negated exit times, so
+    // a single max narrows both intervals on each axis. Max takes the running interval
+    // as its second operand, which it returns when the other one is NaN.
+    SIMD::F4 t = SIMD::set(times_a.x, times_b.x, -times_a.y, -times_b.y);
+    for(int i = 0; i < 3; i++) {
+        bool s = ray.sign[i];
+        const float *a_near = s ? a.max.data : a.min.data, *a_far = s ? a.min.data : a.max.data;
+        const float *b_near = s ? b.max.data : b.min.data, *b_far = s ? b.min.data : b.max.data;
+        SIMD::F4 planes = SIMD::set(a_near[i], b_near[i], a_far[i], b_far[i]);
+        float inv = ray.inv_dir[i];
+        SIMD::F4 slab = SIMD::mul(SIMD::sub(planes, SIMD::splat(ray.point[i])),
+                                  SIMD::set(inv, inv, -inv, -inv));
+        t = SIMD::max(slab, t);
+    }
+
+    float out[4];
+    SIMD::store(t, out);
+    int mask = 0;
+    if(out[0] <= -out[2]) {
+        times_a = Vec2{out[0], -out[2]};
+        mask |= 1;
+    }
+    if(out[1] <= -out[3]) {
+        times_b = Vec2{out[1], -out[3]};
+        mask |= 2;
+    }
+    return mask;
 }
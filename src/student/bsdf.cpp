@@ -42,7 +42,7 @@ Scatter BSDF_Lambertian::scatter(Vec3 out_dir) const {
     return ret;
 }
 
-Spectrum BSDF_Lambertian::evaluate(Vec3 out_dir, Vec3 in_dir) const {
+Spectrum4 BSDF_Lambertian::evaluate(Vec3 out_dir, Vec3 in_dir) const {
 
     // TODO (PathTracer): Task 4
 
@@ -66,7 +66,7 @@ Scatter BSDF_Mirror::scatter(Vec3 out_dir) const {
 
     Scatter ret;
     ret.direction = Vec3();
-    ret.attenuation = Spectrum{};
+    ret.attenuation = Spectrum4{};
     return ret;
 }
 
@@ -83,7 +83,7 @@ Scatter BSDF_Glass::scatter(Vec3 out_dir) const {
 
     Scatter ret;
     ret.direction = Vec3();
-    ret.attenuation = Spectrum{};
+    ret.attenuation = Spectrum4{};
     return ret;
 }
 
@@ -95,11 +95,11 @@ Scatter BSDF_Refract::scatter(Vec3 out_dir) const {
 
     Scatter ret;
     ret.direction = Vec3();
-    ret.attenuation = Spectrum{};
+    ret.attenuation = Spectrum4{};
     return ret;
 }
 
-Spectrum BSDF_Diffuse::emissive() const {
+Spectrum4 BSDF_Diffuse::emissive() const {
     return radiance;
 }
 
@@ -1,12 +1,15 @@
 
 #include "../rays/bvh.h"
 #include "debug.h"
+#include <algorithm>
+#include <cstring>
 #include <stack>
 
 namespace PT {
 
 template<typename Primitive>
-void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size) {
+void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size,
+                           Thread_Pool* pool) {
 
     // NOTE (PathTracer):
     // This BVH is parameterized on the type of the primitive it contains. This allows
@@ -16,104 +19,557 @@ void BVH<Primitive>::build(std::vector<Primitive>&& prims, size_t max_leaf_size)
     //
     // The Primitive interface must implement these two functions:
     //      BBox bbox() const;
-    //      Trace hit(const Ray& ray) const;
-    // Hence, you may call bbox() and hit() on any value of type Primitive.
+    //      Hit intersect(const Ray& ray) const;
+    // Hence, you may call bbox() and intersect() on any value of type Primitive.
     //
     // Finally, also note that while a BVH is a tree structure, our BVH nodes don't
     // contain pointers to children, but rather indicies. This is because instead
     // of allocating each node individually, the BVH class contains a vector that
     // holds all of the nodes. Hence, to get the child of a node, you have to
-    // look up the child index in this vector (e.g. nodes[node.l]). Similarly,
+    // look up the child index in this vector (e.g. build_nodes[node.l]). Similarly,
     // to create a new node, don't allocate one yourself - use BVH::new_node, which
-    // returns the index of a newly added node.
+    // returns the index of a newly added node. Once the tree is complete, flatten()
+    // converts it into the compact depth-first layout used for traversal.
 
     // Keep these
     nodes.clear();
     primitives = std::move(prims);
+    built_cost = 0.0f;
 
-    // TODO (PathTracer): Task 3
-    // Construct a BVH from the given vector of primitives and maximum leaf
-    // size configuration. The starter code builds a BVH with a
-    // single leaf node (which is also the root) that encloses all the
-    // primitives.
+    if(primitives.empty()) return;
+    assert(primitives.size() < UINT32_MAX);
 
-    // Replace these
-    BBox box;
-    for(const Primitive& prim : primitives) box.enclose(prim.bbox());
+    // The builder only moves these records around; the primitives themselves are
+    // reordered once at the end to match the leaf ranges.
+    std::vector<Build_Prim> build_prims(primitives.size());
+    for(size_t i = 0; i < primitives.size(); i++) {
+        BBox box = primitives[i].bbox();
+        build_prims[i] = {box, box.center(), i};
+    }
+
+    max_leaf_size = std::max(max_leaf_size, size_t(1));
+    size_t root = build_node(build_prims, 0, build_prims.size(), max_leaf_size, 0, pool);
+    flatten(root);
+    built_cost = sah_cost();
 
-    new_node(box, 0, primitives.size(), 0, 0);
-    root_idx = 0;
+    std::vector<Primitive> ordered;
+    ordered.reserve(primitives.size());
+    for(const Build_Prim& p : build_prims) {
+        ordered.push_back(std::move(primitives[p.index]));
+    }
+    primitives = std::move(ordered);
 }
 
-template<typename Primitive> Trace BVH<Primitive>::hit(const Ray& ray) const {
+template<typename Primitive>
+size_t BVH<Primitive>::build_node(std::vector<Build_Prim>& prims, size_t start, size_t size,
+                                  size_t max_leaf_size, size_t depth, Thread_Pool* pool) {
+
+    BBox box, centers;
+    for(size_t i = start; i < start + size; i++) {
+        box.enclose(prims[i].box);
+        centers.enclose(prims[i].center);
+    }
+
+    if(size <= max_leaf_size) return new_node(box, start, size, 0, 0);
+
+    // Bin primitive centers along each axis and pick the split plane with the lowest
+    // surface area heuristic cost. The traversal and intersection costs are taken to
+    // be equal, so the cost of a split is SA(l) * N(l) + SA(r) * N(r).
+    static const size_t n_bins = 16;
+    struct Bin {
+        BBox box;
+        size_t count = 0;
+    };
+
+    auto bin_of = [&](const Build_Prim& p, int axis) {
+        float extent = centers.max[axis] - centers.min[axis];
+        float b = (p.center[axis] - centers.min[axis]) * (n_bins / extent);
+        return std::min((size_t)b, n_bins - 1);
+    };
+
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    size_t best_bin = 0;
+
+    // Past half the depth limit we fall back to median splits, which bound the remaining
+    // depth by log2(size) and keep the traversal stack from overflowing.
+    bool use_sah = depth + 1 < max_depth / 2;
+
+    for(int axis = 0; use_sah && axis < 3; axis++) {
+
+        if(centers.max[axis] - centers.min[axis] <= 0.0f) continue;
+
+        Bin bins[n_bins];
+        for(size_t i = start; i < start + size; i++) {
+            Bin& bin = bins[bin_of(prims[i], axis)];
+            bin.box.enclose(prims[i].box);
+            bin.count++;
+        }
+
+        float right_cost[n_bins] = {};
+        BBox acc;
+        size_t count = 0;
+        for(size_t b = n_bins - 1; b > 0; b--) {
+            acc.enclose(bins[b].box);
+            count += bins[b].count;
+            right_cost[b] = acc.surface_area() * count;
+        }
+
+        acc.reset();
+        count = 0;
+        for(size_t b = 0; b < n_bins - 1; b++) {
+            acc.enclose(bins[b].box);
+            count += bins[b].count;
+            float cost = acc.surface_area() * count + right_cost[b + 1];
+            if(count > 0 && count < size && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    size_t mid = start;
+    if(best_axis >= 0) {
+        auto first = prims.begin() + start;
+        auto split = std::partition(first, first + size, [&](const Build_Prim& p) {
+            return bin_of(p, best_axis) <= best_bin;
+        });
+        mid = split - prims.begin();
+    }
+
+    if(mid == start || mid == start + size) {
+        // No useful plane (e.g. all centers coincide): split at the median of the widest
+        // axis so that leaves still respect max_leaf_size.
+        Vec3 extent = centers.max - centers.min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                       : (extent.y > extent.z ? 1 : 2);
+        mid = start + size / 2;
+        auto first = prims.begin() + start;
+        std::nth_element(first, prims.begin() + mid, first + size,
+                         [axis](const Build_Prim& a, const Build_Prim& b) {
+                             return a.center[axis] < b.center[axis];
+                         });
+    }
+
+    size_t node = new_node(box, start, size, 0, 0);
+    size_t l, r;
 
-    // TODO (PathTracer): Task 3
-    // Implement ray - BVH intersection test. A ray intersects
-    // with a BVH aggregate if and only if it intersects a primitive in
-    // the BVH that is not an aggregate.
+    if(pool && size >= parallel_threshold) {
 
-    // The starter code simply iterates through all the primitives.
-    // Again, remember you can use hit() on any Primitive value.
+        // Build the right subtree into a scratch tree on the pool, then splice its nodes
+        // in after the left subtree. The two subtrees own disjoint ranges of prims.
+        BVH<Primitive> right;
+        size_t right_root = 0;
+        std::future<void> done = pool->enqueue([&]() {
+            right_root = right.build_node(prims, mid, start + size - mid, max_leaf_size,
+                                          depth + 1, pool);
+        });
+        l = build_node(prims, start, mid - start, max_leaf_size, depth + 1, pool);
+        pool->help_until(done);
 
-    Trace ret;
-    for(const Primitive& prim : primitives) {
-        Trace hit = prim.hit(ray);
-        ret = Trace::min(ret, hit);
+        size_t offset = build_nodes.size();
+        for(Build_Node n : right.build_nodes) {
+            if(n.l != n.r) {
+                n.l += offset;
+                n.r += offset;
+            }
+            build_nodes.push_back(n);
+        }
+        r = right_root + offset;
+
+    } else {
+        l = build_node(prims, start, mid - start, max_leaf_size, depth + 1, pool);
+        r = build_node(prims, mid, start + size - mid, max_leaf_size, depth + 1, pool);
+    }
+
+    build_nodes[node].l = l;
+    build_nodes[node].r = r;
+    return node;
+}
+
+template<typename Primitive> void BVH<Primitive>::flatten(size_t root) {
+
+    static_assert(sizeof(Node) == 32, "Two BVH nodes should fit in a cache line");
+
+    nodes.clear();
+    nodes.reserve(build_nodes.size());
+
+    // Pre-order walk; the left child is pushed last so it is emitted right after its
+    // parent, and the parent's right index is patched once the right child is emitted.
+    static const size_t no_parent = SIZE_MAX;
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.push_back({root, no_parent});
+
+    while(!stack.empty()) {
+
+        auto [idx, parent] = stack.back();
+        stack.pop_back();
+
+        const Build_Node& b = build_nodes[idx];
+        uint32_t flat = (uint32_t)nodes.size();
+        if(parent != no_parent) nodes[parent].start = flat;
+
+        Node n;
+        n.bbox = b.bbox;
+        if(b.l == b.r) {
+            n.start = (uint32_t)b.start;
+            n.size = (uint32_t)b.size;
+        } else {
+            n.start = 0;
+            n.size = 0;
+            stack.push_back({b.r, flat});
+            stack.push_back({b.l, no_parent});
+        }
+        nodes.push_back(n);
+    }
+
+    build_nodes.clear();
+    build_nodes.shrink_to_fit();
+}
+
+template<typename Primitive> Hit BVH<Primitive>::intersect(const Ray& ray) const {
+
+    Hit ret;
+    if(nodes.empty()) return ret;
+
+    Traversal_Ray tray(ray);
+    Vec2 times = ray.dist_bounds;
+    if(!nodes[0].bbox.hit(tray, times)) return ret;
+
+    // Front-to-back traversal: each stack entry remembers where the ray enters the
+    // node, so subtrees behind the closest hit found so far are skipped.
+    std::pair<uint32_t, float> stack[max_depth];
+    size_t top = 0;
+    stack[top++] = {0, times.x};
+
+    while(top > 0) {
+
+        auto [idx, entry] = stack[--top];
+        if(ret.hit && entry > ret.distance) continue;
+
+        const Node& node = nodes[idx];
+        trace_stats.nodes++;
+
+        if(node.is_leaf()) {
+            trace_stats.primitives += node.size;
+            intersect_leaf(&primitives[node.start], node.size, ray, ret);
+            continue;
+        }
+
+        Vec2 tl = ray.dist_bounds, tr = ray.dist_bounds;
+        if(ret.hit) {
+            tl.y = std::min(tl.y, ret.distance);
+            tr.y = std::min(tr.y, ret.distance);
+        }
+        uint32_t l = node.left(idx), r = node.right();
+        int mask = BBox::hit(nodes[l].bbox, nodes[r].bbox, tray, tl, tr);
+        bool hit_l = mask & 1, hit_r = mask & 2;
+
+        if(hit_l && hit_r) {
+            if(tl.x <= tr.x) {
+                stack[top++] = {r, tr.x};
+                stack[top++] = {l, tl.x};
+            } else {
+                stack[top++] = {l, tl.x};
+                stack[top++] = {r, tr.x};
+            }
+        } else if(hit_l) {
+            stack[top++] = {l, tl.x};
+        } else if(hit_r) {
+            stack[top++] = {r, tr.x};
+        }
     }
     return ret;
 }
 
+template<typename Primitive> bool BVH<Primitive>::occluded(const Ray& ray) const {
+
+    if(nodes.empty()) return false;
+
+    // Any hit will do, so nodes are visited without ordering them by distance and the
+    // traversal ends at the first primitive the ray hits.
+    Traversal_Ray tray(ray);
+    uint32_t stack[max_depth];
+    size_t top = 0;
+    stack[top++] = 0;
+
+    while(top > 0) {
+
+        uint32_t idx = stack[--top];
+        const Node& node = nodes[idx];
+
+        Vec2 times = ray.dist_bounds;
+        if(!node.bbox.hit(tray, times)) continue;
+        trace_stats.nodes++;
+
+        if(node.is_leaf()) {
+            trace_stats.primitives += node.size;
+            if(occluded_leaf(&primitives[node.start], node.size, ray)) return true;
+            continue;
+        }
+
+        stack[top++] = node.right();
+        stack[top++] = node.left(idx);
+    }
+    return false;
+}
+
+template<typename Primitive>
+void BVH<Primitive>::intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+
+    assert(n <= max_packet_size);
+    if(nodes.empty() || n == 0) return;
+
+    // When every ray points into the same octant, bounding the packet's origins and
+    // inverse directions per axis gives (by interval arithmetic) a range of entry and
+    // exit distances containing those of every ray. Boxes for which that range is empty
+    // are culled without testing the rays one by one.
+    Traversal_Ray trays[max_packet_size];
+    bool frustum = true;
+    Vec3 o_min(FLT_MAX), o_max(-FLT_MAX), i_min(FLT_MAX), i_max(-FLT_MAX);
+    float t_min = FLT_MAX, t_max = -FLT_MAX;
+    for(size_t r = 0; r < n; r++) {
+        trays[r] = Traversal_Ray(rays[r]);
+        for(int a = 0; a < 3; a++) {
+            float inv = trays[r].inv_dir[a];
+            if(!std::isfinite(inv) || trays[r].sign[a] != trays[0].sign[a]) frustum = false;
+            o_min[a] = std::min(o_min[a], rays[r].point[a]);
+            o_max[a] = std::max(o_max[a], rays[r].point[a]);
+            i_min[a] = std::min(i_min[a], inv);
+            i_max[a] = std::max(i_max[a], inv);
+        }
+        float bound = rays[r].dist_bounds.y;
+        if(hits[r].hit) bound = std::min(bound, hits[r].distance);
+        t_min = std::min(t_min, rays[r].dist_bounds.x);
+        t_max = std::max(t_max, bound);
+    }
+
+    auto frustum_miss = [&](const BBox& box) {
+        float enter = t_min, leave = t_max;
+        for(int a = 0; a < 3; a++) {
+            bool neg = i_max[a] < 0.0f;
+            float lo = neg ? box.max[a] : box.min[a];
+            float hi = neg ? box.min[a] : box.max[a];
+            float n0 = (lo - o_max[a]) * i_min[a], n1 = (lo - o_max[a]) * i_max[a];
+            float n2 = (lo - o_min[a]) * i_min[a], n3 = (lo - o_min[a]) * i_max[a];
+            float f0 = (hi - o_max[a]) * i_min[a], f1 = (hi - o_max[a]) * i_max[a];
+            float f2 = (hi - o_min[a]) * i_min[a], f3 = (hi - o_min[a]) * i_max[a];
+            enter = std::max(enter, std::min(std::min(n0, n1), std::min(n2, n3)));
+            leave = std::min(leave, std::max(std::max(f0, f1), std::max(f2, f3)));
+        }
+        return enter > leave;
+    };
+
+    auto ray_hit = [&](const BBox& box, uint32_t r) {
+        Vec2 times = rays[r].dist_bounds;
+        if(hits[r].hit) times.y = std::min(times.y, hits[r].distance);
+        return box.hit(trays[r], times);
+    };
+
+    // Each stack entry holds a node and the first ray that may still hit it: the rays
+    // before it missed one of the node's ancestors. Nodes are fetched once per packet.
+    std::pair<uint32_t, uint32_t> stack[max_depth];
+    size_t top = 0;
+    stack[top++] = {0, 0};
+
+    while(top > 0) {
+
+        auto [idx, first] = stack[--top];
+        const Node& node = nodes[idx];
+        trace_stats.nodes++;
+
+        if(frustum && frustum_miss(node.bbox)) continue;
+        while(first < n && !ray_hit(node.bbox, first)) first++;
+        if(first == n) continue;
+
+        if(node.is_leaf()) {
+            uint32_t last = (uint32_t)n - 1;
+            while(last > first && !ray_hit(node.bbox, last)) last--;
+            uint32_t count = last - first + 1;
+            trace_stats.primitives += node.size * count;
+            intersect_leaf_packet(&primitives[node.start], node.size, rays + first, hits + first,
+                                  count);
+            continue;
+        }
+
+        // Descend into the child nearer along the first active ray first
+        uint32_t l = node.left(idx), r = node.right();
+        Vec3 delta = nodes[r].bbox.center() - nodes[l].bbox.center();
+        if(dot(delta, rays[first].dir) >= 0.0f) {
+            stack[top++] = {r, first};
+            stack[top++] = {l, first};
+        } else {
+            stack[top++] = {l, first};
+            stack[top++] = {r, first};
+        }
+    }
+}
+
 template<typename Primitive>
-BVH<Primitive>::BVH(std::vector<Primitive>&& prims, size_t max_leaf_size) {
-    build(std::move(prims), max_leaf_size);
+BVH<Primitive>::BVH(std::vector<Primitive>&& prims, size_t max_leaf_size, Thread_Pool* pool) {
+    build(std::move(prims), max_leaf_size, pool);
+}
+
+template<typename Primitive> float BVH<Primitive>::refit() {
+
+    if(nodes.empty()) return 1.0f;
+
+    // Children always follow their parent in the depth-first layout, so a reverse sweep
+    // updates both children of a node before the node itself.
+    for(size_t i = nodes.size(); i-- > 0;) {
+        Node& node = nodes[i];
+        node.bbox.reset();
+        if(node.is_leaf()) {
+            for(size_t p = node.start; p < node.start + node.size; p++) {
+                node.bbox.enclose(primitives[p].bbox());
+            }
+        } else {
+            node.bbox.enclose(nodes[node.left((uint32_t)i)].bbox);
+            node.bbox.enclose(nodes[node.right()].bbox);
+        }
+    }
+
+    if(built_cost <= 0.0f) return 1.0f;
+    return sah_cost() / built_cost;
+}
+
+template<typename Primitive> float BVH<Primitive>::sah_cost() const {
+
+    // Expected cost of tracing a ray that hits the root, with the same equal traversal and
+    // intersection costs the builder assumes.
+    if(nodes.empty()) return 0.0f;
+    float root_area = nodes[0].bbox.surface_area();
+    if(root_area <= 0.0f) return 0.0f;
+
+    float cost = 0.0f;
+    for(const Node& node : nodes) {
+        cost += node.bbox.surface_area() * (node.is_leaf() ? node.size : 1.0f);
+    }
+    return cost / root_area;
 }
 
 template<typename Primitive> BVH<Primitive> BVH<Primitive>::copy() const {
     BVH<Primitive> ret;
     ret.nodes = nodes;
     ret.primitives = primitives;
-    ret.root_idx = root_idx;
+    ret.built_cost = built_cost;
     return ret;
 }
 
 template<typename Primitive> bool BVH<Primitive>::Node::is_leaf() const {
 
-    // A node is a leaf if l == r, since all interior nodes must have distinct children
-    return l == r;
+    // Leaves are never empty, so only interior nodes have size == 0
+    return size != 0;
+}
+
+template<typename Primitive> uint32_t BVH<Primitive>::Node::left(uint32_t idx) const {
+    return idx + 1;
+}
+
+template<typename Primitive> uint32_t BVH<Primitive>::Node::right() const {
+    return start;
 }
 
 template<typename Primitive>
 size_t BVH<Primitive>::new_node(BBox box, size_t start, size_t size, size_t l, size_t r) {
-    Node n;
+    Build_Node n;
     n.bbox = box;
     n.start = start;
     n.size = size;
     n.l = l;
     n.r = r;
-    nodes.push_back(n);
-    return nodes.size() - 1;
+    build_nodes.push_back(n);
+    return build_nodes.size() - 1;
 }
 
 template<typename Primitive> BBox BVH<Primitive>::bbox() const {
-    return nodes[root_idx].bbox;
+    if(nodes.empty()) return {};
+    return nodes[0].bbox;
+}
+
+template<typename Primitive> template<typename F> void BVH<Primitive>::for_each_leaf(F&& f) {
+    for(const Node& node : nodes) {
+        if(node.is_leaf()) f(&primitives[node.start], (size_t)node.size);
+    }
+}
+
+template<typename Primitive> const void* BVH<Primitive>::node_data(size_t& bytes) const {
+    bytes = nodes.size() * sizeof(Node);
+    return nodes.data();
+}
+
+template<typename Primitive>
+const std::vector<Primitive>& BVH<Primitive>::leaf_primitives() const {
+    return primitives;
+}
+
+template<typename Primitive>
+bool BVH<Primitive>::restore(const void* data, size_t bytes, std::vector<Primitive>&& prims) {
+
+    clear();
+    if(bytes % sizeof(Node) || (bytes == 0) != prims.empty()) return false;
+
+    std::vector<Node> loaded(bytes / sizeof(Node));
+    std::memcpy(loaded.data(), data, bytes);
+
+    // Walking down from the root must reach every node exactly once, and the leaves must
+    // cover every primitive exactly once; otherwise traversal could skip primitives. Both
+    // children of an interior node must follow it, which refit() relies on, and traversal
+    // relies on the tree being no deeper than the builder makes. The stored bounds are not
+    // trusted: refit() recomputes them from the primitives.
+    std::vector<bool> reached(loaded.size(), false), covered(prims.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack;
+    if(!loaded.empty()) stack.push_back({0, 0});
+    while(!stack.empty()) {
+        auto [i, depth] = stack.back();
+        stack.pop_back();
+        if(reached[i] || depth >= max_depth) return false;
+        reached[i] = true;
+
+        const Node& node = loaded[i];
+        if(node.is_leaf()) {
+            if((size_t)node.start + node.size > prims.size()) return false;
+            for(size_t p = node.start; p < (size_t)node.start + node.size; p++) {
+                if(covered[p]) return false;
+                covered[p] = true;
+            }
+        } else {
+            if(node.right() <= i + 1 || node.right() >= loaded.size()) return false;
+            stack.push_back({node.right(), depth + 1});
+            stack.push_back({i + 1, depth + 1});
+        }
+    }
+    if(std::find(reached.begin(), reached.end(), false) != reached.end() ||
+       std::find(covered.begin(), covered.end(), false) != covered.end()) {
+        return false;
+    }
+
+    nodes = std::move(loaded);
+    primitives = std::move(prims);
+    refit();
+    built_cost = sah_cost();
+    return true;
 }
 
 template<typename Primitive> std::vector<Primitive> BVH<Primitive>::destructure() {
     nodes.clear();
+    built_cost = 0.0f;
     return std::move(primitives);
 }
 
 template<typename Primitive> void BVH<Primitive>::clear() {
     nodes.clear();
     primitives.clear();
+    built_cost = 0.0f;
 }
 
 template<typename Primitive>
 size_t BVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
                                  const Mat4& trans) const {
 
-    std::stack<std::pair<size_t, size_t>> tstack;
-    tstack.push({root_idx, 0});
+    std::stack<std::pair<uint32_t, size_t>> tstack;
+    tstack.push({0, 0});
     size_t max_level = 0;
 
     if(nodes.empty()) return max_level;
@@ -148,8 +604,8 @@ size_t BVH<Primitive>::visualize(GL::Lines& lines, GL::Lines& active, size_t lev
         edge(Vec3{max.x, min.y, min.z}, Vec3{max.x, min.y, max.z});
 
         if(!node.is_leaf()) {
-            tstack.push({node.l, lvl + 1});
-            tstack.push({node.r, lvl + 1});
+            tstack.push({node.left(idx), lvl + 1});
+            tstack.push({node.right(), lvl + 1});
         } else {
             for(size_t i = node.start; i < node.start + node.size; i++) {
                 size_t c = primitives[i].visualize(lines, active, level - lvl, trans);
@@ -1,39 +1,71 @@
 
 #include "../rays/env_light.h"
 
+#include <algorithm>
 #include <limits>
 
 namespace PT {
 
-Vec3 Env_Map::sample() const {
+Tiled_Image::Tiled_Image(const HDR_Image& image) {
+
+    const auto [_w, _h] = image.dimension();
+    w = _w;
+    h = _h;
+    tiles_w = (w + tile - 1) / tile;
+    size_t tiles_h = (h + tile - 1) / tile;
+    texels.assign(tiles_w * tiles_h * tile * tile, Spectrum{});
+
+    for(size_t y = 0; y < h; y++) {
+        for(size_t x = 0; x < w; x++) {
+            size_t t = (y / tile) * tiles_w + x / tile;
+            texels[t * tile * tile + (y % tile) * tile + x % tile] = image.at(x, y);
+        }
+    }
+}
 
-    // TODO (PathTracer): Task 7
+Spectrum Tiled_Image::at(size_t x, size_t y) const {
+    size_t t = (y / tile) * tiles_w + x / tile;
+    return texels[t * tile * tile + (y % tile) * tile + x % tile];
+}
 
-    // First, implement Samplers::Sphere::Uniform so the following line works.
-    // Second, implement Samplers::Sphere::Image and swap to image_sampler
+Spectrum Tiled_Image::bilinear(Vec2 uv) const {
 
-    return uniform_sampler.sample();
-}
+    if(w == 0 || h == 0) return {};
 
-float Env_Map::pdf(Vec3 dir) const {
+    float fx = uv.x * w - 0.5f;
+    float fy = uv.y * h - 0.5f;
+    float x0 = std::floor(fx), y0 = std::floor(fy);
+    float tx = fx - x0, ty = fy - y0;
 
-    // TODO (PathTracer): Task 7
+    long iw = (long)w, ih = (long)h;
+    long xa = ((long)x0 % iw + iw) % iw;
+    long xb = (xa + 1) % iw;
+    long ya = std::clamp((long)y0, 0l, ih - 1);
+    long yb = std::clamp((long)y0 + 1, 0l, ih - 1);
 
-    // First, return the pdf for a uniform spherical distribution.
-    // Second, swap to image_sampler.pdf().
+    Spectrum bottom = at(xa, ya) * (1.0f - tx) + at(xb, ya) * tx;
+    Spectrum top = at(xa, yb) * (1.0f - tx) + at(xb, yb) * tx;
+    return bottom * (1.0f - ty) + top * ty;
+}
 
-    return 0.0f;
+size_t Tiled_Image::bytes() const {
+    return texels.size() * sizeof(Spectrum);
 }
 
-Spectrum Env_Map::evaluate(Vec3 dir) const {
+Vec3 Env_Map::sample() const {
+    return image_sampler.sample();
+}
 
-    // TODO (PathTracer): Task 7
+float Env_Map::pdf(Vec3 dir) const {
+    return image_sampler.pdf(dir);
+}
 
-    // Compute emitted radiance along a given direction by finding the corresponding
-    // pixels in the enviornment image. You should bi-linearly interpolate the value
-    // between the 4 nearest pixels.
+Spectrum Env_Map::evaluate(Vec3 dir) const {
+    return radiance.bilinear(Samplers::Sphere::to_uv(dir));
+}
 
-    return Spectrum{};
+size_t Env_Map::bytes() const {
+    return image_sampler.bytes() + radiance.bytes();
 }
 
 Vec3 Env_Hemisphere::sample() const {
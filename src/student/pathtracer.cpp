@@ -8,9 +8,16 @@ namespace PT {
 
 Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
 
+    // Pathtracer::trace() returns the incoming light split into emissive and reflected components.
+    auto [emissive, reflected] = trace(camera_ray(x, y));
+    return emissive + reflected;
+}
+
+Ray Pathtracer::camera_ray(size_t x, size_t y) {
+
     // TODO (PathTracer): Task 1
 
-    // Generate a ray that uniformly samples pixel (x,y) and return the incoming light.
+    // Generate a ray that uniformly samples pixel (x,y).
     // The following code generates a ray at the bottom left of the pixel every time.
 
     // Tip: Samplers::Rect::Uniform
@@ -19,7 +26,7 @@ Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
     Samplers::Rect random_rect;
 
     
-    Vec2 xy((float)x + random_rect.sample().x, (float)y + random_rect.sample().y);
+    Vec2 xy = Vec2((float)x, (float)y) + random_rect.sample();
     //Vec2 xy((float)x  , (float)y );              // x goes from 0 to 639 and y goes from 0 to 359
     
     Vec2 wh((float)out_w, (float)out_h);         // 640 x 360
@@ -29,26 +36,22 @@ Spectrum Pathtracer::trace_pixel(size_t x, size_t y) {
     ray.depth = max_depth;
     
     if(RNG::coin_flip(0.0005f)) log_ray(ray, 10.0f);
-
-    // Pathtracer::trace() returns the incoming light split into emissive and reflected components.
-    auto [emissive, reflected] = trace(ray);
-    return emissive + reflected;
+    return ray;
 }
 
-Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
+Ray Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
 
     // TODO (PathTrace): Task 4
 
-    // This function computes a single-sample Monte Carlo estimate of the _indirect_
-    // lighting at our ray intersection point.
+    // This function samples the next segment of the path through our ray intersection
+    // point. Pathtracer::trace() follows it and accumulates the _indirect_ lighting.
 
     // (1) Randomly sample a new ray direction from the BSDF distribution using BSDF::scatter().
 
     Scatter sct = hit.bsdf.scatter(hit.out_dir);
 
-    // (2) Create a new world-space ray and call Pathtracer::trace() to get incoming light. You
-    // should modify time_bounds so that the ray does not intersect at time = 0. Remember to
-    // set the new depth value.
+    // (2) Create a new world-space ray. You should modify time_bounds so that the ray does
+    // not intersect at time = 0. Remember to set the new depth value.
 
 
     Ray w;
@@ -61,7 +64,6 @@ Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
     w.depth = hit.depth - 1;
     w.dist_bounds = Vec2(EPS_F, 2.0f); // how to modify this
     w.point += w.dir * EPS_F;
-    auto incoming = trace(w);
 
     //auto cos_theta = dot(sct.direction, hit.normal);
 
@@ -69,23 +71,16 @@ Spectrum Pathtracer::sample_indirect_lighting(const Shading_Info& hit) {
     
     //auto cos_theta = dot(hit.world_to_object.rotate(sct.direction), hit.normal);
 
-    // (3) Add contribution due to incoming light scaled by BSDF attenuation. Whether you
-    // compute the BSDF scattering PDF should depend on if the BSDF is a discrete distribution
-    // (see BSDF::is_discrete()).
-
-    // You should only use the indirect component of incoming light (the second value returned
-    // by Pathtracer::trace()), as the direct component will be computed in
-    // Pathtracer::sample_direct_lighting().
+    // (3) Set the ray's throughput to the BSDF attenuation the light it finds is scaled by.
+    // Whether you compute the BSDF scattering PDF should depend on if the BSDF is a discrete
+    // distribution (see BSDF::is_discrete()).
 
+    // Only the indirect component of the light it finds is used, as the direct component
+    // is computed in Pathtracer::sample_direct_lighting().
 
-    Spectrum radiance;
-
-    radiance =
-        sct.attenuation * incoming.second * cos_theta / hit.bsdf.pdf(sct.direction, hit.normal);
+    w.throughput = sct.attenuation.spectrum() * cos_theta / hit.bsdf.pdf(sct.direction, hit.normal);
    
-    
-    // Spectrum radiance; 
-    return radiance;
+    return w;
 }
 
 Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
@@ -125,7 +120,7 @@ Spectrum Pathtracer::sample_direct_lighting(const Shading_Info& hit) {
     //auto cos_theta = dot(hit.world_to_object.rotate(sct.direction), hit.normal);
 
     radiance = radiance +
-        incoming.first * sct.attenuation * cos_theta / hit.bsdf.pdf(sct.direction, hit.normal);
+        incoming.first * sct.attenuation.spectrum() * cos_theta / hit.bsdf.pdf(sct.direction, hit.normal);
 
 
     // TODO (PathTrace): Task 6
@@ -160,43 +155,71 @@ std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray) {
     // surface the ray hits, and reflected through that point from other sources.
 
     // Trace ray into scene.
-    Trace result = scene.hit(ray);
-    if(!result.hit) {
+    trace_stats.rays++;
+    return trace(ray, scene.hit(ray));
+}
+
+std::pair<Spectrum, Spectrum> Pathtracer::trace(const Ray& ray, Trace result) {
+
+    // Follows the path starting with a ray, whose intersection may come from a single-ray
+    // query or from a packet of camera rays. Each bounce adds the direct lighting at the
+    // surface it hits, scaled by the throughput of the path up to that surface.
+    Spectrum emissive, reflected;
+    Ray path = ray;
+    for(size_t bounce = 0;; bounce++) {
 
-        // If no surfaces were hit, sample the environemnt map.
-        if(env_light.has_value()) {
-            return {env_light.value().evaluate(ray.dir), {}};
+        if(!result.hit) {
+
+            // If no surfaces were hit, sample the environemnt map. Later bounces have
+            // already counted it as direct lighting.
+            if(bounce == 0 && env_light.has_value()) {
+                emissive = env_light.value().evaluate(path.dir);
+            }
+            break;
         }
-        return {};
-    }
 
-    // If we're using a two-sided material, treat back-faces the same as front-faces
-    const BSDF& bsdf = materials[result.material];
-    if(!bsdf.is_sided() && dot(result.normal, ray.dir) > 0.0f) {
-        result.normal = -result.normal;
-    }
+        // If we're using a two-sided material, treat back-faces the same as front-faces
+        const BSDF& bsdf = materials[result.material];
+        if(!bsdf.is_sided() && dot(result.normal, path.dir) > 0.0f) {
+            result.normal = -result.normal;
+        }
+
+        // TODO (PathTracer): Task 4
+        // You will want to change the default normal_colors in debug.h, or delete this early out.
+        //if(debug_data.normal_colors) return {Spectrum::direction(result.normal), {}};
+
+        // If the BSDF is emissive, stop tracing and return the emitted light
+        Spectrum emitted = bsdf.emissive().spectrum();
+        if(emitted.luma() > 0.0f) {
+            if(bounce == 0) emissive = emitted;
+            break;
+        }
+
+        // If the ray has reached maximum depth, stop tracing
+        if(path.depth == 0) break;
 
-    // TODO (PathTracer): Task 4
-    // You will want to change the default normal_colors in debug.h, or delete this early out.
-    //if(debug_data.normal_colors) return {Spectrum::direction(result.normal), {}};
+        // Set up shading information
+        Mat4 object_to_world = Mat4::rotate_to(result.normal);
+        Mat4 world_to_object = object_to_world.T();
+        Vec3 out_dir = world_to_object.rotate(path.point - result.position).unit();
 
-    // If the BSDF is emissive, stop tracing and return the emitted light
-    Spectrum emissive = bsdf.emissive();
-    if(emissive.luma() > 0.0f) return {emissive, {}};
+        Shading_Info hit = {bsdf,    world_to_object, object_to_world, result.position,
+                            out_dir, result.normal,   path.depth};
 
-    // If the ray has reached maximum depth, stop tracing
-    if(ray.depth == 0) return {};
+        // Add light reflected through the intersection, then continue the path unless
+        // Russian roulette ends it
+        reflected += path.throughput * sample_direct_lighting(hit);
 
-    // Set up shading information
-    Mat4 object_to_world = Mat4::rotate_to(result.normal);
-    Mat4 world_to_object = object_to_world.T();
-    Vec3 out_dir = world_to_object.rotate(ray.point - result.position).unit();
+        Ray next = sample_indirect_lighting(hit);
+        next.throughput *= path.throughput;
+        if(!survives(next.throughput, bounce + 1)) break;
 
-    Shading_Info hit = {bsdf,    world_to_object, object_to_world, result.position,
-                        out_dir, result.normal,   ray.depth};
+        path = next;
+        trace_stats.rays++;
+        result = scene.hit(path);
+    }
 
-    // Sample and return light reflected through the intersection
-    return {{}, sample_direct_lighting(hit) + sample_indirect_lighting(hit)};
+    return {emissive, reflected};
 }
 
 } // namespace PT
@@ -9,9 +9,9 @@ Vec2 Rect::sample() const {
     // TODO (PathTracer): Task 1
 
     // Generate a uniformly random point on a rectangle of size size.x * size.y
-    // Tip: RNG::unit()
+    // Tip: RNG::sample_2D()
     
-    return Vec2{RNG::unit()*size.x, RNG::unit()*size.y};
+    return RNG::sample_2D() * size;
 }
 
 Vec3 Sphere::Uniform::sample() const {
@@ -24,35 +24,68 @@ Vec3 Sphere::Uniform::sample() const {
     return Vec3{};
 }
 
-Sphere::Image::Image(const HDR_Image& image) {
+Vec2 Sphere::to_uv(Vec3 dir) {
+    float phi = std::atan2(dir.z, dir.x);
+    if(phi < 0.0f) phi += 2.0f * PI_F;
+    float theta = std::acos(clamp(dir.y, -1.0f, 1.0f));
+    return Vec2{phi / (2.0f * PI_F), 1.0f - theta / PI_F};
+}
 
-    // TODO (PathTracer): Task 7
+Vec3 Sphere::from_uv(Vec2 uv) {
+    float phi = 2.0f * PI_F * uv.x;
+    float theta = PI_F * (1.0f - uv.y);
+    float sin_theta = std::sin(theta);
+    return Vec3{sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi)};
+}
 
-    // Set up importance sampling data structures for a spherical environment map image.
-    // You may make use of the _pdf, _cdf, and total members, or create your own.
+Sphere::Image::Image(const HDR_Image& image) {
 
     const auto [_w, _h] = image.dimension();
     w = _w;
     h = _h;
+
+    // A pixel subtends (2pi / w) * (pi / h) * sin(theta) steradians, taking theta at its
+    // center; the constant factor does not change the distribution.
+    std::vector<float> weights(w * h);
+    for(size_t y = 0; y < h; y++) {
+        float sin_theta = std::sin(PI_F * (1.0f - (y + 0.5f) / h));
+        for(size_t x = 0; x < w; x++) {
+            weights[y * w + x] = image.at(x, y).luma() * sin_theta;
+        }
+    }
+    pixels = Alias(weights);
 }
 
 Vec3 Sphere::Image::sample() const {
 
-    // TODO (PathTracer): Task 7
-
-    // Use your importance sampling data structure to generate a sample direction.
-    // Tip: std::upper_bound
+    if(pixels.empty()) return Vec3{0.0f, 1.0f, 0.0f};
 
-    return Vec3{};
+    size_t i = pixels.sample();
+    Vec2 jitter = RNG::sample_2D();
+    Vec2 uv{((i % w) + jitter.x) / w, ((i / w) + jitter.y) / h};
+    // Rounding may land exactly on the pole, where the density is undefined
+    uv.y = std::min(uv.y, std::nextafter(1.0f, 0.0f));
+    return from_uv(uv);
 }
 
 float Sphere::Image::pdf(Vec3 dir) const {
 
-    // TODO (PathTracer): Task 7
+    if(pixels.empty()) return 0.0f;
+
+    // The density is uniform over each pixel in (u, v). Mapping the unit square to
+    // (phi, theta) divides it by 2pi^2, and dw = sin(theta) dphi dtheta divides it by
+    // sin(theta).
+    float sin_theta = Vec2{dir.x, dir.z}.norm();
+    if(sin_theta <= 0.0f) return 0.0f;
 
-    // What is the PDF of this distribution at a particular direction?
+    Vec2 uv = to_uv(dir);
+    size_t x = std::min((size_t)(uv.x * w), w - 1);
+    size_t y = std::min((size_t)(uv.y * h), h - 1);
+    return pixels.pmf(y * w + x) * (w * h) / (2.0f * PI_F * PI_F * sin_theta);
+}
 
-    return 0.0f;
+size_t Sphere::Image::bytes() const {
+    return pixels.bins.size() * sizeof(Alias::Bin) + pixels._pmf.size() * sizeof(float);
 }
 
 Vec3 Point::sample() const {
@@ -60,17 +93,76 @@ Vec3 Point::sample() const {
 }
 
 Vec3 Triangle::sample() const {
-    float u = std::sqrt(RNG::unit());
-    float v = RNG::unit();
+    Vec2 xi = RNG::sample_2D();
+    float u = std::sqrt(xi.x);
+    float v = xi.y;
     float a = u * (1.0f - v);
     float b = u * v;
     return a * v0 + b * v1 + (1.0f - a - b) * v2;
 }
 
+Alias::Alias(const std::vector<float>& weights) {
+
+    size_t n = weights.size();
+    bins.assign(n, Bin{});
+    _pmf.assign(n, n ? 1.0f / n : 0.0f);
+    if(n == 0) return;
+
+    double sum = 0.0;
+    for(float w : weights) sum += std::max(w, 0.0f);
+    total = (float)sum;
+    if(!(sum > 0.0)) return;
+
+    // Scale the weights so they average one, then repeatedly top up an underfull bin with
+    // the excess of an overfull one. Every step settles one bin, so this takes O(n).
+    std::vector<double> scaled(n);
+    std::vector<uint32_t> small, large;
+    for(size_t i = 0; i < n; i++) {
+        double w = std::max(weights[i], 0.0f);
+        _pmf[i] = (float)(w / sum);
+        scaled[i] = w * n / sum;
+        (scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+    }
+    while(!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        bins[s] = {(float)scaled[s], l};
+        scaled[l] -= 1.0 - scaled[s];
+        if(scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left is full up to rounding error
+    for(uint32_t i : small) bins[i] = {1.0f, i};
+    for(uint32_t i : large) bins[i] = {1.0f, i};
+}
+
+size_t Alias::sample() const {
+    return sample(RNG::sample_1D());
+}
+
+size_t Alias::sample(float u) const {
+    // The integer part of u * n picks the bin and the fraction decides between its two
+    // indices, so one number is enough.
+    float x = u * bins.size();
+    size_t i = std::min((size_t)x, bins.size() - 1);
+    return x - i < bins[i].q ? i : bins[i].alias;
+}
+
+float Alias::pmf(size_t i) const {
+    return _pmf[i];
+}
+
+bool Alias::empty() const {
+    return bins.empty();
+}
+
 Vec3 Hemisphere::Uniform::sample() const {
 
-    float Xi1 = RNG::unit();
-    float Xi2 = RNG::unit();
+    Vec2 xi = RNG::sample_2D();
+    float Xi1 = xi.x;
+    float Xi2 = xi.y;
 
     float theta = std::acos(Xi1);
     float phi = 2.0f * PI_F * Xi2;
@@ -84,8 +176,9 @@ Vec3 Hemisphere::Uniform::sample() const {
 
 Vec3 Hemisphere::Cosine::sample() const {
 
-    float phi = RNG::unit() * 2.0f * PI_F;
-    float cos_t = std::sqrt(RNG::unit());
+    Vec2 xi = RNG::sample_2D();
+    float phi = xi.x * 2.0f * PI_F;
+    float cos_t = std::sqrt(xi.y);
 
     float sin_t = std::sqrt(1 - cos_t * cos_t);
     float x = std::cos(phi) * sin_t;
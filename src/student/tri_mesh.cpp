@@ -2,6 +2,8 @@
 #include "../rays/tri_mesh.h"
 #include "../rays/samplers.h"
 
+#include <algorithm>
+
 namespace PT {
 
 BBox Triangle::bbox() const {
@@ -12,78 +14,268 @@ BBox Triangle::bbox() const {
     // Beware of flat/zero-volume boxes! You may need to
     // account for that here, or later on in BBox::intersect.
 
+    // Flat boxes are fine: BBox::hit accepts zero-width slabs.
     BBox box;
+    box.enclose(vertex_list[v0].position);
+    box.enclose(vertex_list[v1].position);
+    box.enclose(vertex_list[v2].position);
     return box;
 }
 
-Trace Triangle::hit(const Ray& ray) const {
+Hit Triangle::intersect(const Ray& ray) const {
 
     // Each vertex contains a postion and surface normal
-    Tri_Mesh_Vert v_0 = vertex_list[v0];
-    Tri_Mesh_Vert v_1 = vertex_list[v1];
-    Tri_Mesh_Vert v_2 = vertex_list[v2];
-    (void)v_0;
-    (void)v_1;
-    (void)v_2;
-        
+    Vec3 p_0 = vertex_list[v0].position;
+    Vec3 p_1 = vertex_list[v1].position;
+    Vec3 p_2 = vertex_list[v2].position;
+
     // TODO (PathTracer): Task 2
     // Intersect the ray with the triangle defined by the three vertices.
-    // 
-    Vec3 e1 = v_1.position - v_0.position;
-    Vec3 e2 = v_2.position - v_0.position;
-    Vec3 s = ray.point - v_0.position;
+    //
+    // Only the distance and barycentric coordinates are needed to find the closest hit;
+    // Triangle::finalize computes the rest of the Trace once the closest hit is known.
+    Vec3 e1 = p_1 - p_0;
+    Vec3 e2 = p_2 - p_0;
+    Vec3 s = ray.point - p_0;
     Vec3 d = ray.dir;
-    float det = dot(cross(e1, d), e2);
 
-    /*if(det == 0.0f) {
-        det = 0.00001f;
-    }*/
-    // assert(det != 0);
-    // check for det == 0
-    
+    Vec3 e1_d = cross(e1, d), s_e2 = cross(s, e2);
+    float det = dot(e1_d, e2);
 
-    if(det != 0) {
-        bool hit_status = false;
+    Hit ret;
+    if(det == 0.0f) return ret;
 
-        Vec3 params = (1.0f / det) * Vec3((-1.0f) * dot(cross(s, e2), d), dot(cross(e1, d), s),
-                                          (-1.0f) * dot(cross(s, e2), e1));
+    float inv_det = 1.0f / det;
+    float u = -dot(s_e2, d) * inv_det;
+    float v = dot(e1_d, s) * inv_det;
+    float t = -dot(s_e2, e1) * inv_det;
 
-        Vec3 intersect_point = ray.point + (params.z) * ray.dir;
+    if(u > 0.0f && v > 0.0f && 1.0f - u - v > 0.0f && t >= ray.dist_bounds.x &&
+       t <= ray.dist_bounds.y) {
+        ret.hit = true;
+        ret.distance = t;
+        ret.uv = Vec2(u, v);
+        ret.triangle = this;
+    }
+    return ret;
+}
 
-        if(params.x > 0.0f && params.y > 0.0f && (1.0f - params.x - params.y) > 0.0f) {
-            if(params.z >= ray.dist_bounds.x && params.z <= ray.dist_bounds.y) {
-                hit_status = true;
-            }
-        }
+Trace Triangle::finalize(const Hit& hit, const Ray& ray) const {
 
-        // TODO (PathTracer): Task 2
-        // Intersect the ray with the triangle defined by the three vertices.
-
-        Trace ret;
-        ret.origin = ray.point;
-        ret.hit = hit_status;           // was there an intersection?
-        ret.distance = params.z;        // at what distance did the intersection occur?
-        ret.position = intersect_point; // where was the intersection?
-        ret.normal = ((1.0f - params.x - params.y) * v_0.normal) + (params.x * v_1.normal) +
-                     (params.y *
-                      v_2.normal); // what was the surface normal at the intersection?
-                                   // (this should be interpolated between the three vertex normals)
-        return ret;
-    } else {
+    Trace ret;
+    ret.origin = ray.point;
+    ret.hit = hit.hit; // was there an intersection?
+    if(!hit.hit) return ret;
+    ret.distance = hit.distance;         // at what distance did the intersection occur?
+    ret.position = ray.at(hit.distance); // where was the intersection?
 
-        Trace ret;
-        ret.origin = ray.point;
-        ret.hit = false;       // was there an intersection?
-        ret.distance = 0.0f;   // at what distance did the intersection occur?
-        ret.position = Vec3{}; // where was the intersection?
-        ret.normal = Vec3{};   // what was the surface normal at the intersection?
-                               // (this should be interpolated between the three vertex normals)
+    // What was the surface normal at the intersection?
+    // (this should be interpolated between the three vertex normals)
+    float u = hit.uv.x, v = hit.uv.y;
+    ret.normal = (1.0f - u - v) * vertex_list[v0].normal + u * vertex_list[v1].normal +
+                 v * vertex_list[v2].normal;
+    return ret;
+}
+
+Trace Triangle::hit(const Ray& ray) const {
+    return finalize(intersect(ray), ray);
+}
+
+// Just enough of a SIMD float type to write Tri_Block::intersect once for every width
+namespace {
+struct Lanes {
+#if defined(MBVH_AVX)
+    __m256 v;
+    static Lanes load(const float* p) {
+        return {_mm256_load_ps(p)};
+    }
+    static Lanes set(float f) {
+        return {_mm256_set1_ps(f)};
+    }
+    void store(float* p) const {
+        _mm256_storeu_ps(p, v);
+    }
+    Lanes operator+(Lanes r) const {
+        return {_mm256_add_ps(v, r.v)};
+    }
+    Lanes operator-(Lanes r) const {
+        return {_mm256_sub_ps(v, r.v)};
+    }
+    Lanes operator*(Lanes r) const {
+        return {_mm256_mul_ps(v, r.v)};
+    }
+    Lanes operator/(Lanes r) const {
+        return {_mm256_div_ps(v, r.v)};
+    }
+    // Bitmasks of the lanes where the comparison holds (never where either side is NaN)
+    int operator>(Lanes r) const {
+        return _mm256_movemask_ps(_mm256_cmp_ps(v, r.v, _CMP_GT_OQ));
+    }
+    int operator>=(Lanes r) const {
+        return _mm256_movemask_ps(_mm256_cmp_ps(v, r.v, _CMP_GE_OQ));
+    }
+#elif defined(MBVH_SSE)
+    __m128 v;
+    static Lanes load(const float* p) {
+        return {_mm_load_ps(p)};
+    }
+    static Lanes set(float f) {
+        return {_mm_set1_ps(f)};
+    }
+    void store(float* p) const {
+        _mm_storeu_ps(p, v);
+    }
+    Lanes operator+(Lanes r) const {
+        return {_mm_add_ps(v, r.v)};
+    }
+    Lanes operator-(Lanes r) const {
+        return {_mm_sub_ps(v, r.v)};
+    }
+    Lanes operator*(Lanes r) const {
+        return {_mm_mul_ps(v, r.v)};
+    }
+    Lanes operator/(Lanes r) const {
+        return {_mm_div_ps(v, r.v)};
+    }
+    int operator>(Lanes r) const {
+        return _mm_movemask_ps(_mm_cmpgt_ps(v, r.v));
+    }
+    int operator>=(Lanes r) const {
+        return _mm_movemask_ps(_mm_cmpge_ps(v, r.v));
+    }
+#else
+    static const int width = Tri_Block::width;
+    float v[width];
+    template<typename F> static Lanes map(F&& f) {
+        Lanes ret;
+        for(int i = 0; i < width; i++) ret.v[i] = f(i);
+        return ret;
+    }
+    template<typename F> static int mask(F&& f) {
+        int ret = 0;
+        for(int i = 0; i < width; i++) ret |= f(i) ? 1 << i : 0;
         return ret;
     }
+    static Lanes load(const float* p) {
+        return map([p](int i) { return p[i]; });
+    }
+    static Lanes set(float f) {
+        return map([f](int) { return f; });
+    }
+    void store(float* p) const {
+        for(int i = 0; i < width; i++) p[i] = v[i];
+    }
+    Lanes operator+(const Lanes& r) const {
+        return map([&](int i) { return v[i] + r.v[i]; });
+    }
+    Lanes operator-(const Lanes& r) const {
+        return map([&](int i) { return v[i] - r.v[i]; });
+    }
+    Lanes operator*(const Lanes& r) const {
+        return map([&](int i) { return v[i] * r.v[i]; });
+    }
+    Lanes operator/(const Lanes& r) const {
+        return map([&](int i) { return v[i] / r.v[i]; });
+    }
+    int operator>(const Lanes& r) const {
+        return mask([&](int i) { return v[i] > r.v[i]; });
+    }
+    int operator>=(const Lanes& r) const {
+        return mask([&](int i) { return v[i] >= r.v[i]; });
+    }
+#endif
+};
+
+struct Lanes3 {
+    Lanes x, y, z;
+};
+Lanes3 cross(const Lanes3& a, const Lanes3& b) {
+    return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+Lanes dot(const Lanes3& a, const Lanes3& b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+} // namespace
+
+int Tri_Block::intersect(const Ray& ray, Vec2 bounds, float (&t)[width], float (&u)[width],
+                         float (&v)[width]) const {
+
+    // The test in Triangle::intersect, run on every lane at once
+    Lanes3 p0 = {Lanes::load(v0[0]), Lanes::load(v0[1]), Lanes::load(v0[2])};
+    Lanes3 a = {Lanes::load(e1[0]), Lanes::load(e1[1]), Lanes::load(e1[2])};
+    Lanes3 b = {Lanes::load(e2[0]), Lanes::load(e2[1]), Lanes::load(e2[2])};
+    Lanes3 d = {Lanes::set(ray.dir.x), Lanes::set(ray.dir.y), Lanes::set(ray.dir.z)};
+    Lanes3 s = {Lanes::set(ray.point.x) - p0.x, Lanes::set(ray.point.y) - p0.y,
+                Lanes::set(ray.point.z) - p0.z};
+
+    Lanes3 e1_d = cross(a, d), s_e2 = cross(s, b);
+    Lanes det = dot(e1_d, b);
+
+    Lanes zero = Lanes::set(0.0f), one = Lanes::set(1.0f);
+    Lanes inv_det = one / det;
+    Lanes lu = (zero - dot(s_e2, d)) * inv_det;
+    Lanes lv = dot(e1_d, s) * inv_det;
+    Lanes lt = (zero - dot(s_e2, a)) * inv_det;
+
+    // Degenerate lanes have det == 0, which the first test rejects without relying on
+    // how the resulting infinities compare.
+    int mask = (det * det > zero) & (lu > zero) & (lv > zero) & (one - lu - lv > zero) &
+               (lt >= Lanes::set(bounds.x)) & (Lanes::set(bounds.y) >= lt);
+
+    lt.store(t);
+    lu.store(u);
+    lv.store(v);
+    return mask;
+}
+
+void intersect_leaf(const Triangle* tris, size_t n, const Ray& ray, Hit& hit) {
+
+    const Tri_Block* block = tris[0].block;
+    if(!block) return intersect_leaf<Triangle>(tris, n, ray, hit);
+
+    const int width = Tri_Block::width;
+    for(size_t b = 0; b * width < n; b++) {
+
+        Vec2 bounds = ray.dist_bounds;
+        if(hit.hit) bounds.y = std::min(bounds.y, hit.distance);
+
+        float t[width], u[width], v[width];
+        int mask = block[b].intersect(ray, bounds, t, u, v);
+        for(int i = 0; i < width; i++) {
+            if(!(mask & (1 << i)) || (hit.hit && t[i] > hit.distance)) continue;
+            Hit h;
+            h.hit = true;
+            h.distance = t[i];
+            h.uv = Vec2(u[i], v[i]);
+            h.triangle = &tris[b * width + i];
+            hit = h;
+        }
+    }
+}
+
+void intersect_leaf_packet(const Triangle* tris, size_t n, const Ray* rays, Hit* hits,
+                           size_t count) {
+    for(size_t r = 0; r < count; r++) {
+        intersect_leaf(tris, n, rays[r], hits[r]);
+    }
 }
 
-Triangle::Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2)
-    : vertex_list(verts), v0(v0), v1(v1), v2(v2) {
+bool occluded_leaf(const Triangle* tris, size_t n, const Ray& ray) {
+
+    const Tri_Block* block = tris[0].block;
+    if(!block) return occluded_leaf<Triangle>(tris, n, ray);
+
+    const int width = Tri_Block::width;
+    for(size_t b = 0; b * width < n; b++) {
+        float t[width], u[width], v[width];
+        if(block[b].intersect(ray, ray.dist_bounds, t, u, v)) return true;
+    }
+    return false;
+}
+
+Triangle::Triangle(Tri_Mesh_Vert* verts, unsigned int v0, unsigned int v1, unsigned int v2,
+                   unsigned int index)
+    : v0(v0), v1(v1), v2(v2), index(index), vertex_list(verts) {
 }
 
 Vec3 Triangle::sample(Vec3 from) const {
@@ -95,14 +287,14 @@ Vec3 Triangle::sample(Vec3 from) const {
     return (pos - from).unit();
 }
 
-float Triangle::pdf(Ray wray, const Mat4& T, const Mat4& iT) const {
+float Triangle::pdf(Ray wray, const Affine& T, const Affine& iT) const {
 
     Ray tray = wray;
     tray.transform(iT);
 
     Trace trace = hit(tray);
     if(trace.hit) {
-        trace.transform(T, iT.T());
+        trace.transform(T, iT);
         Vec3 v_0 = T * vertex_list[v0].position;
         Vec3 v_1 = T * vertex_list[v1].position;
         Vec3 v_2 = T * vertex_list[v2].position;
@@ -114,11 +306,13 @@ float Triangle::pdf(Ray wray, const Mat4& T, const Mat4& iT) const {
     return 0.0f;
 }
 
-void Tri_Mesh::build(const GL::Mesh& mesh, bool bvh) {
+void Tri_Mesh::copy_mesh(const GL::Mesh& mesh) {
 
-    use_bvh = bvh;
     verts.clear();
+    indices.clear();
+    area = std::make_unique<Area_Sampler>();
     triangle_bvh.clear();
+    triangle_mbvh.clear();
     triangle_list.clear();
 
     for(const auto& v : mesh.verts()) {
@@ -126,60 +320,251 @@ void Tri_Mesh::build(const GL::Mesh& mesh, bool bvh) {
     }
 
     const auto& idxs = mesh.indices();
+    indices.assign(idxs.begin(), idxs.begin() + idxs.size() / 3 * 3);
+}
+
+void Tri_Mesh::build(const GL::Mesh& mesh, bool bvh, bool wide, Thread_Pool* pool) {
+
+    use_bvh = bvh;
+    wide_bvh = bvh && wide;
+    copy_mesh(mesh);
 
     std::vector<Triangle> tris;
-    for(size_t i = 0; i < idxs.size(); i += 3) {
-        tris.push_back(Triangle(verts.data(), idxs[i], idxs[i + 1], idxs[i + 2]));
+    for(size_t i = 0; i < indices.size(); i += 3) {
+        tris.push_back(Triangle(verts.data(), indices[i], indices[i + 1], indices[i + 2],
+                                (unsigned int)(i / 3)));
     }
 
-    if(use_bvh) {
-        triangle_bvh.build(std::move(tris), 4);
+    if(wide_bvh) {
+        triangle_mbvh.build(std::move(tris), leaf_size, pool);
+    } else if(use_bvh) {
+        triangle_bvh.build(std::move(tris), leaf_size, pool);
     } else {
         triangle_list = List<Triangle>(std::move(tris));
     }
+    build_blocks();
 }
 
-Tri_Mesh::Tri_Mesh(const GL::Mesh& mesh, bool use_bvh) {
-    build(mesh, use_bvh);
+const void* Tri_Mesh::bvh_nodes(size_t& bytes) const {
+    if(wide_bvh) return triangle_mbvh.node_data(bytes);
+    return triangle_bvh.node_data(bytes);
+}
+
+std::vector<uint32_t> Tri_Mesh::bvh_triangles() const {
+    const auto& tris = wide_bvh ? triangle_mbvh.leaf_primitives() : triangle_bvh.leaf_primitives();
+    std::vector<uint32_t> ret;
+    ret.reserve(tris.size());
+    for(const Triangle& tri : tris) {
+        ret.push_back(tri.index);
+    }
+    return ret;
+}
+
+bool Tri_Mesh::restore(const GL::Mesh& mesh, bool wide, const void* nodes, size_t node_bytes,
+                       const uint32_t* order, size_t n_triangles) {
+
+    use_bvh = true;
+    wide_bvh = wide;
+    copy_mesh(mesh);
+
+    if(3 * n_triangles != indices.size()) return false;
+
+    // The leaves must hold every one of the mesh's triangles exactly once, or a stale file
+    // (or a hash collision) would make intersections silently go missing. Here the leaf
+    // order must list each triangle once, and the BVH checks that its leaves reach every
+    // entry of it once. The triangles are made from the mesh's own indices, so they cannot
+    // differ from it otherwise.
+    std::vector<bool> seen(n_triangles, false);
+    std::vector<Triangle> tris;
+    tris.reserve(n_triangles);
+    for(size_t i = 0; i < n_triangles; i++) {
+        uint32_t t = order[i];
+        if(t >= n_triangles || seen[t]) return false;
+        seen[t] = true;
+        tris.push_back(Triangle(verts.data(), indices[3 * t], indices[3 * t + 1],
+                                indices[3 * t + 2], t));
+    }
+
+    bool ok = wide_bvh ? triangle_mbvh.restore(nodes, node_bytes, std::move(tris))
+                       : triangle_bvh.restore(nodes, node_bytes, std::move(tris));
+    if(!ok) return false;
+    build_blocks();
+    return true;
+}
+
+void Tri_Mesh::build_blocks() {
+
+    // Leaves never move their triangles, so each one gets its own run of blocks
+    const int width = Tri_Block::width;
+    auto visit = [this](auto&& f) {
+        if(wide_bvh) triangle_mbvh.for_each_leaf(f);
+        else if(use_bvh) triangle_bvh.for_each_leaf(f);
+    };
+
+    size_t count = 0;
+    visit([&](Triangle*, size_t n) { count += (n + width - 1) / width; });
+    blocks.assign(count, Tri_Block{});
+
+    size_t next = 0;
+    visit([&](Triangle* tris, size_t n) {
+        tris[0].block = &blocks[next];
+        for(size_t i = 0; i < n; i++) {
+            Tri_Block& block = blocks[next + i / width];
+            size_t lane = i % width;
+            const Triangle& tri = tris[i];
+            Vec3 p0 = verts[tri.v0].position;
+            Vec3 e1 = verts[tri.v1].position - p0;
+            Vec3 e2 = verts[tri.v2].position - p0;
+            for(int a = 0; a < 3; a++) {
+                block.v0[a][lane] = p0[a];
+                block.e1[a][lane] = e1[a];
+                block.e2[a][lane] = e2[a];
+            }
+        }
+        next += (n + width - 1) / width;
+    });
+}
+
+const Samplers::Alias& Tri_Mesh::area_sampler() const {
+    std::call_once(area->built, [this] {
+        std::vector<float> areas(indices.size() / 3);
+        for(size_t i = 0; i < areas.size(); i++) {
+            Vec3 p0 = verts[indices[3 * i]].position;
+            Vec3 p1 = verts[indices[3 * i + 1]].position;
+            Vec3 p2 = verts[indices[3 * i + 2]].position;
+            areas[i] = 0.5f * cross(p1 - p0, p2 - p0).norm();
+        }
+        area->alias = Samplers::Alias(areas);
+    });
+    return area->alias;
+}
+
+Tri_Mesh::Tri_Mesh(const GL::Mesh& mesh, bool use_bvh, bool wide_bvh, Thread_Pool* pool) {
+    build(mesh, use_bvh, wide_bvh, pool);
+}
+
+bool Tri_Mesh::refit(const GL::Mesh& mesh, Thread_Pool* pool) {
+
+    // Only the triangles this was built from are kept, so trailing indices that do not make
+    // up a whole triangle are ignored here as well
+    const auto& idxs = mesh.indices();
+    if(mesh.verts().size() != verts.size() || idxs.size() / 3 * 3 != indices.size() ||
+       !std::equal(indices.begin(), indices.end(), idxs.begin())) {
+        return false;
+    }
+
+    // Triangles point into verts, which keeps its size, so they see the new positions
+    const auto& src = mesh.verts();
+    for(size_t i = 0; i < verts.size(); i++) {
+        verts[i] = {src[i].pos, src[i].norm};
+    }
+
+    float cost = 1.0f;
+    if(wide_bvh) cost = triangle_mbvh.refit();
+    else if(use_bvh) cost = triangle_bvh.refit();
+
+    if(cost > max_refit_cost) {
+        build(mesh, use_bvh, wide_bvh, pool);
+    } else {
+        area = std::make_unique<Area_Sampler>();
+        build_blocks();
+    }
+    return true;
 }
 
 Tri_Mesh Tri_Mesh::copy() const {
     Tri_Mesh ret;
     ret.verts = verts;
     ret.triangle_bvh = triangle_bvh.copy();
+    ret.triangle_mbvh = triangle_mbvh.copy();
     ret.triangle_list = triangle_list.copy();
     ret.use_bvh = use_bvh;
+    ret.wide_bvh = wide_bvh;
+    ret.indices = indices;
+    ret.build_blocks();
     return ret;
 }
 
 BBox Tri_Mesh::bbox() const {
+    if(wide_bvh) return triangle_mbvh.bbox();
     if(use_bvh) return triangle_bvh.bbox();
     return triangle_list.bbox();
 }
 
 Trace Tri_Mesh::hit(const Ray& ray) const {
-    if(use_bvh) return triangle_bvh.hit(ray);
-    return triangle_list.hit(ray);
+    return finalize(intersect(ray), ray);
+}
+
+Hit Tri_Mesh::intersect(const Ray& ray) const {
+    if(wide_bvh) return triangle_mbvh.intersect(ray);
+    if(use_bvh) return triangle_bvh.intersect(ray);
+    return triangle_list.intersect(ray);
+}
+
+Trace Tri_Mesh::finalize(const Hit& hit, const Ray& ray) const {
+    if(!hit.hit) return {};
+    return hit.triangle->finalize(hit, ray);
+}
+
+void Tri_Mesh::intersect_packet(const Ray* rays, Hit* hits, size_t n) const {
+    if(wide_bvh) return triangle_mbvh.intersect_packet(rays, hits, n);
+    if(use_bvh) return triangle_bvh.intersect_packet(rays, hits, n);
+    triangle_list.intersect_packet(rays, hits, n);
+}
+
+bool Tri_Mesh::occluded(const Ray& ray) const {
+    if(wide_bvh) return triangle_mbvh.occluded(ray);
+    if(use_bvh) return triangle_bvh.occluded(ray);
+    return triangle_list.occluded(ray);
 }
 
 size_t Tri_Mesh::visualize(GL::Lines& lines, GL::Lines& active, size_t level,
                            const Mat4& trans) const {
+    if(wide_bvh) return triangle_mbvh.visualize(lines, active, level, trans);
     if(use_bvh) return triangle_bvh.visualize(lines, active, level, trans);
     return 0;
 }
 
 Vec3 Tri_Mesh::sample(Vec3 from) const {
-    if(use_bvh) {
-        die("Sampling BVH-based triangle meshes is not yet supported.");
-    }
-    return triangle_list.sample(from);
+    const Samplers::Alias& alias = area_sampler();
+    if(alias.empty()) return {};
+    size_t i = 3 * alias.sample();
+    Samplers::Triangle sampler(verts[indices[i]].position, verts[indices[i + 1]].position,
+                               verts[indices[i + 2]].position);
+    return (sampler.sample() - from).unit();
 }
 
-float Tri_Mesh::pdf(Ray ray, const Mat4& T, const Mat4& iT) const {
-    if(use_bvh) {
-        die("Sampling BVH-based triangle meshes is not yet supported.");
+float Tri_Mesh::pdf(Ray ray, const Affine& T, const Affine& iT) const {
+
+    float total = area_sampler().total;
+    if(!(total > 0.0f)) return 0.0f;
+
+    // Without normalizing the direction, distances along the local ray match those along
+    // the world ray.
+    Ray local = ray;
+    local.point = iT * ray.point;
+    local.dir = iT.rotate(ray.dir);
+
+    // The direction may cross the surface several times, and sample() could have chosen
+    // any of those points. Each crossing is found in turn by restarting past the last one.
+    float ret = 0.0f;
+    for(Hit hit = intersect(local); hit.hit; hit = intersect(local)) {
+        const Triangle& tri = *hit.triangle;
+        Vec3 p0 = verts[tri.v0].position, p1 = verts[tri.v1].position;
+        Vec3 p2 = verts[tri.v2].position;
+        float area = 0.5f * cross(p1 - p0, p2 - p0).norm();
+
+        // The point is uniform over the transformed triangle, whose area may differ
+        Vec3 n = cross(T.rotate(p1 - p0), T.rotate(p2 - p0));
+        float world_area = 0.5f * n.norm();
+        float cos = std::abs(dot(n.unit(), ray.dir));
+        if(world_area > 0.0f && cos > 0.0f) {
+            float choose = area / total;
+            ret += choose * hit.distance * hit.distance / (world_area * cos);
+        }
+        local.dist_bounds.x = std::nextafter(hit.distance, FLT_MAX);
     }
-    return triangle_list.pdf(ray, T, iT);
+    return ret;
 }
 
 } // namespace PT
@@ -1,6 +1,7 @@
 
 #include "hdr_image.h"
 #include "../lib/log.h"
+#include "../lib/spectrum4.h"
 
 #include <sf_libs/stb_image.h>
 #include <sf_libs/tinyexr.h>
@@ -166,23 +167,26 @@ void HDR_Image::tonemap_to(std::vector<unsigned char>& data, float e) const {
 
     if(data.size() != w * h * 4) data.resize(w * h * 4);
 
+    // All three channels are mapped at once. Adding 0.5 before truncating rounds to the
+    // nearest byte, since the values are clamped to be non-negative first.
+    SIMD::F4 scale = SIMD::splat(-e), one = SIMD::splat(1.0f);
     for(size_t j = 0; j < h; j++) {
         for(size_t i = 0; i < w; i++) {
 
             size_t pidx = (h - j - 1) * w + i;
-            const Spectrum& sample = pixels[pidx];
+            Spectrum4 sample(pixels[pidx]);
 
-            float r = 1.0f - std::exp(-sample.r * exposure);
-            float g = 1.0f - std::exp(-sample.g * exposure);
-            float b = 1.0f - std::exp(-sample.b * exposure);
-
-            Spectrum out(r, g, b);
+            Spectrum4 out(SIMD::sub(one, SIMD::exp(SIMD::mul(sample.v, scale))));
             out = out.to_srgb();
 
+            float bytes[4];
+            SIMD::F4 v = SIMD::add(SIMD::mul(out.v, SIMD::splat(255.0f)), SIMD::splat(0.5f));
+            SIMD::store(SIMD::min(SIMD::max(v, SIMD::splat(0.0f)), SIMD::splat(255.0f)), bytes);
+
             size_t didx = 4 * (j * w + i);
-            data[didx] = (unsigned char)std::round(out.r * 255.0f);
-            data[didx + 1] = (unsigned char)std::round(out.g * 255.0f);
-            data[didx + 2] = (unsigned char)std::round(out.b * 255.0f);
+            data[didx] = (unsigned char)bytes[0];
+            data[didx + 1] = (unsigned char)bytes[1];
+            data[didx + 2] = (unsigned char)bytes[2];
             data[didx + 3] = 255;
         }
     }
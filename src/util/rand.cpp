@@ -2,22 +2,27 @@
 #include "rand.h"
 #include "../lib/mathlib.h"
 
-#include <ctime>
+#include <atomic>
 #include <random>
-#include <thread>
 
 namespace RNG {
 
-static thread_local std::mt19937 rng;
+static thread_local PCG32 rng;
 
 float unit() {
-    std::uniform_real_distribution<float> d(0.0f, 1.0f);
-    return d(rng);
+    return rng.unit();
+}
+
+void fill(float* out, size_t n) {
+    PCG32 local = rng;
+    for(size_t i = 0; i < n; i++) out[i] = local.unit();
+    rng = local;
 }
 
 int integer(int min, int max) {
-    std::uniform_int_distribution<int> d(min, max - 1);
-    return d(rng);
+    // Scale a 32 bit value into the range (Lemire, 2019); the bias is negligible here
+    uint64_t range = (uint64_t)(max - min);
+    return min + (int)((rng.next() * range) >> 32);
 }
 
 bool coin_flip(float p) {
@@ -25,12 +30,142 @@ bool coin_flip(float p) {
 }
 
 void seed() {
-    std::random_device r;
-    std::random_device::result_type seed =
-        r() ^
-        (std::random_device::result_type)std::hash<std::thread::id>()(std::this_thread::get_id()) ^
-        (std::random_device::result_type)std::hash<time_t>()(std::time(nullptr));
-    rng.seed(seed);
+    static const uint64_t process_seed = ((uint64_t)std::random_device{}() << 32) ^
+                                         (uint64_t)std::random_device{}();
+    static std::atomic<uint64_t> next_stream = 0;
+    rng.seed(process_seed, next_stream++);
+}
+
+void seed(uint64_t seed, uint64_t stream) {
+    rng.seed(seed, stream);
+}
+
+struct Sample_State {
+    bool active = false;
+    Sequence seq = Sequence::random;
+    uint32_t key = 0, index = 0, dimension = 0;
+};
+
+static thread_local Sample_State state;
+
+static uint32_t mix(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash(uint32_t a, uint32_t b) {
+    return mix(a ^ mix(b + 0x9e3779b9u));
+}
+
+static float to_unit(uint32_t x) {
+    return (float)(x >> 8) * 0x1p-24f;
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Hash-based nested uniform (Owen) scrambling: each bit is flipped depending on the bits
+// above it (Burley, "Practical Hash-based Owen Scrambling", 2020)
+static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+static float sobol(uint32_t key, uint32_t index, uint32_t dim) {
+
+    // Dimensions are taken in pairs from the 2D Sobol sequence, which is well stratified in
+    // every pair. Each pair of each pixel shuffles the sample order and scrambles the points
+    // with its own seed, which decorrelates the pairs from each other.
+    uint32_t seed = hash(key, dim / 2);
+    uint32_t i = owen_scramble(index, seed);
+
+    uint32_t x = 0;
+    if(dim & 1) {
+        for(uint32_t v = 1u << 31; i; i >>= 1, v ^= v >> 1) {
+            if(i & 1) x ^= v;
+        }
+    } else {
+        x = reverse_bits(i);
+    }
+    return to_unit(owen_scramble(x, hash(seed, dim)));
+}
+
+static float halton(uint32_t key, uint32_t index, uint32_t dim) {
+
+    static const uint32_t primes[] = {2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,
+                                      37,  41,  43,  47,  53,  59,  61,  67,  71,  73,  79,
+                                      83,  89,  97,  101, 103, 107, 109, 113, 127, 131};
+    static const uint32_t n_primes = sizeof(primes) / sizeof(primes[0]);
+
+    // Higher dimensions of the Halton sequence are poorly distributed, so they fall back
+    // to hashing the sample
+    if(dim >= n_primes) return to_unit(hash(hash(key, index), dim));
+
+    // Radical inverse, with each digit scrambled by a random linear permutation per pixel.
+    // Unlike a random shift, this spreads out the leading digits of consecutive samples.
+    uint32_t base = primes[dim], seed = hash(key, dim);
+    float inv_base = 1.0f / base, scale = inv_base, result = 0.0f;
+    for(uint32_t digit = 0; scale > 1e-7f; digit++) {
+        uint32_t h = hash(seed, digit);
+        uint32_t a = base > 2 ? 1 + (h >> 16) % (base - 1) : 1, b = (h & 0xffff) % base;
+        uint32_t d = (a * (index % base) + b) % base;
+        result += d * scale;
+        index /= base;
+        scale *= inv_base;
+    }
+    return std::min(result, 0x1.fffffep-1f);
+}
+
+void begin_sample(Sequence seq, uint32_t seed, uint32_t pixel, uint32_t index,
+                  uint32_t dimension) {
+    state.active = true;
+    state.seq = seq;
+    state.key = hash(seed, pixel);
+    state.index = index;
+    state.dimension = dimension;
+    // Resuming a sample at a later dimension starts a different stream than its beginning
+    rng.seed(((uint64_t)state.key << 32) | dimension, index);
+}
+
+uint32_t end_sample() {
+    state.active = false;
+    return state.dimension;
+}
+
+float sample_1D() {
+    if(!state.active) return unit();
+    uint32_t dim = state.dimension++;
+    switch(state.seq) {
+    case Sequence::sobol: return sobol(state.key, state.index, dim);
+    case Sequence::halton: return halton(state.key, state.index, dim);
+    default: return unit();
+    }
+}
+
+Vec2 sample_2D() {
+    Vec2 ret;
+    if(state.active && state.seq != Sequence::random) {
+        ret.x = sample_1D();
+        ret.y = sample_1D();
+    } else {
+        fill(ret.data, 2);
+        if(state.active) state.dimension += 2;
+    }
+    return ret;
 }
 
 } // namespace RNG
@@ -3,17 +3,76 @@
 
 #include "../lib/mathlib.h"
 
+#include <cstdint>
+
 namespace RNG {
 
-// Generate random float in the range [0,1]
+// PCG32 (O'Neill, 2014): a small and fast generator with 64 bits of state. Generators with
+// the same seed but different streams produce independent sequences, so each thread (or
+// each unit of work) can draw from its own stream.
+class PCG32 {
+public:
+    PCG32(uint64_t seed = 0x853c49e6748fea9bull, uint64_t stream = 0xda3e39cb94b95bdbull) {
+        this->seed(seed, stream);
+    }
+
+    void seed(uint64_t seed, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1) | 1;
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + inc;
+        uint32_t shifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (shifted >> rot) | (shifted << ((32 - rot) & 31));
+    }
+
+    // Uniform float in the range [0,1)
+    float unit() {
+        return (float)(next() >> 8) * 0x1p-24f;
+    }
+
+private:
+    uint64_t state, inc;
+};
+
+// Generate random float in the range [0,1)
 float unit();
 
+// Fill out with n random floats in the range [0,1)
+void fill(float* out, size_t n);
+
 // Generate random integer in the range [min,max)
 int integer(int min, int max);
 
 // Return true with probability p and false with probability 1-p
 bool coin_flip(float p = 0.5f);
 
-// Seed the current thread's PRNG
+// Seed the current thread's PRNG. Without arguments, the seed is chosen once per process and
+// every thread that calls seed() gets its own stream.
 void seed();
+void seed(uint64_t seed, uint64_t stream);
+
+// Sequences that pixel samples draw their dimensions from
+enum class Sequence : uint8_t { random, halton, sobol };
+
+// Begin drawing the dimensions of sample `index` of `pixel` on the current thread, starting
+// from the given dimension. Until end_sample, sample_1D and sample_2D return the successive
+// coordinates of that sample's point in the sequence. The thread's PRNG is also reseeded from
+// the sample, so every random number the sample uses depends only on (seed, pixel, index).
+void begin_sample(Sequence seq, uint32_t seed, uint32_t pixel, uint32_t index,
+                  uint32_t dimension = 0);
+
+// Stop drawing from the sequence, returning the number of dimensions the sample used
+uint32_t end_sample();
+
+// Generate the next dimension(s) of the current sample in the range [0,1), or uniformly
+// random values if no sample is active
+float sample_1D();
+Vec2 sample_2D();
 } // namespace RNG
@@ -33,6 +33,18 @@ void Thread_Pool::start(size_t threads) {
         });
 }
 
+bool Thread_Pool::run_one() {
+    std::function<void()> task;
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if(stop_now || tasks.empty()) return false;
+        task = std::move(tasks.front());
+        tasks.pop();
+    }
+    task();
+    return true;
+}
+
 void Thread_Pool::clear() {
     stop();
     start(n_threads);
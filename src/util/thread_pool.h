@@ -38,8 +38,17 @@ public:
         return res;
     }
 
+    /// Run queued tasks on the calling thread until the future is ready. This lets a task
+    /// running on the pool block on work it enqueued itself without deadlocking the pool.
+    template<typename T> void help_until(const std::future<T>& f) {
+        while(f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if(!run_one()) std::this_thread::yield();
+        }
+    }
+
 private:
     void start(size_t);
+    bool run_one();
     size_t n_threads;
     bool stop_now = true;
     bool stop_when_done = true;